@@ -1,85 +1,480 @@
 
 
 #include "./include/tcmalloc.hpp"
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-// ntimes 一轮申请和释放内存的次数
-// rounds 轮次
-void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds) {
-    std::vector<std::thread> vthread(nworks);
-    std::atomic<size_t> malloc_costtime(0);
-    std::atomic<size_t> free_costtime(0);
-    for (size_t k = 0; k < nworks; ++k) {
-        vthread[k] = std::thread([&, k]() {
-            std::vector<void*> v;
-            v.reserve(ntimes);
-            for (size_t j = 0; j < rounds; ++j) {
-                size_t begin1 = clock();
-                for (size_t i = 0; i < ntimes; i++) {
-                    v.push_back(malloc(16));
-                    // v.push_back(malloc((16 + i) % 8192 + 1));
-                }
-                size_t end1 = clock();
-                size_t begin2 = clock();
-                for (size_t i = 0; i < ntimes; i++) {
-                    free(v[i]);
-                }
-                size_t end2 = clock();
-                v.clear();
-                malloc_costtime += (end1 - begin1);
-                free_costtime += (end2 - begin2);
-            }
-        });
+// 分配器的基准测试: 每个负载在1到CPU核数个线程下各跑一遍，tcmalloc和glibc的malloc轮流跑
+// 吞吐量按墙上时间算(所有线程一起开始，最后一个线程结束)
+// 延迟每LATENCY_EVERY次操作取一次样，包括了一次steady_clock的开销(几十纳秒)
+// 机器支持硬件计数器的话，再输出每次操作平均的cache miss次数(只算用户态)
+// 用法: ./out [最大线程数] [负载名...]
+
+static const size_t BENCH_OPS = 1 << 20; // 每个线程的操作次数(一次申请或者一次释放算一次)
+static const size_t LATENCY_EVERY = 16;
+static const size_t THREADTEST_OBJS = 1000;
+static const size_t CENTRAL_OBJS = 16384;
+static const size_t BATCH_OBJS = 128;
+static const size_t RANDOM_SLOTS = 1024;
+static const size_t LARSON_SLOTS = 1024;
+static const size_t LARSON_ROUNDS = 16;
+static const size_t XMALLOC_BATCH = 64;
+static const size_t XMALLOC_RING = 16;
+static const size_t REALLOC_BUFS = 64;
+static const size_t REALLOC_MAX = 128 * 1024;
+static const size_t LARGE_OPS = 1 << 14; // 大内存每次都可能要系统调用，少跑一点
+static const size_t LARGE_BUFS = 4;
+
+struct allocator {
+    const char* name;
+    void* (*alloc)(size_t);
+    void (*free)(void*);
+    void* (*realloc)(void*, size_t);
+    void (*alloc_batch)(size_t, size_t, void**);
+    void (*free_batch)(void**, size_t, size_t);
+};
+
+static void* tc_alloc(size_t size) { return tcmalloc(size); }
+static void tc_free(void* ptr) { tcfree(ptr); }
+// 和libc_override.cc里的realloc一样
+static void* tc_realloc(void* old_ptr, size_t size) {
+    if (old_ptr == nullptr)
+        return tcmalloc(size);
+    size_t old_size = tcmalloc_usable_size(old_ptr);
+    if (size <= old_size && size >= old_size / 2)
+        return old_ptr;
+    void* new_ptr = tcmalloc(size);
+    memcpy(new_ptr, old_ptr, std::min(old_size, size));
+    tcfree(old_ptr);
+    return new_ptr;
+}
+static void tc_alloc_batch(size_t size, size_t n, void** out) { tcmalloc_batch(size, n, out); }
+static void tc_free_batch(void** ptrs, size_t n, size_t size) { tcfree_batch(ptrs, n, size); }
+static void* libc_alloc(size_t size) { return malloc(size); }
+static void libc_free(void* ptr) { free(ptr); }
+static void* libc_realloc(void* ptr, size_t size) { return realloc(ptr, size); }
+// glibc没有批量接口，一个一个来
+static void libc_alloc_batch(size_t size, size_t n, void** out) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = malloc(size);
+}
+static void libc_free_batch(void** ptrs, size_t n, size_t /*size*/) {
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
+static const allocator ALLOCATORS[] = {
+    { "tcmalloc", tc_alloc, tc_free, tc_realloc, tc_alloc_batch, tc_free_batch },
+    { "glibc", libc_alloc, libc_free, libc_realloc, libc_alloc_batch, libc_free_batch },
+};
+
+static inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 每个线程一个，所有的申请释放都从这里走，顺便计数和取延迟样本
+class worker {
+public:
+    const allocator* __a;
+    size_t __ops = 0;
+    std::vector<uint32_t> __latency;
+    uint64_t __rng;
+    long long __misses = -1;
+
+public:
+    worker(const allocator* a, size_t tid)
+        : __a(a)
+        , __rng(0x9e3779b97f4a7c15ULL * (tid + 1)) { __latency.reserve(2 * BENCH_OPS / LATENCY_EVERY + 64); }
+    uint64_t next() {
+        __rng ^= __rng << 13;
+        __rng ^= __rng >> 7;
+        __rng ^= __rng << 17;
+        return __rng;
     }
-    for (auto& t : vthread) {
-        t.join();
+    // 大部分是小对象，少数几KB到几十KB，偶尔一个超过256KB的
+    size_t random_size() {
+        uint64_t r = next();
+        size_t p = r % 100;
+        r >>= 8;
+        if (p < 80)
+            return 8 + r % 121;
+        if (p < 95)
+            return 129 + r % 3968;
+        if (p < 99)
+            return 4097 + r % (60 * 1024);
+        return 64 * 1024 + r % (448 * 1024);
+    }
+    void* alloc(size_t size) {
+        void* ptr;
+        if (++__ops % LATENCY_EVERY != 0) {
+            ptr = __a->alloc(size);
+        } else {
+            uint64_t begin = now_ns();
+            ptr = __a->alloc(size);
+            __latency.push_back((uint32_t)(now_ns() - begin));
+        }
+        *(char*)ptr = 1; // 至少碰一下，不然有的分配器根本不用给物理页
+        return ptr;
+    }
+    void free(void* ptr) {
+        if (++__ops % LATENCY_EVERY != 0) {
+            __a->free(ptr);
+            return;
+        }
+        uint64_t begin = now_ns();
+        __a->free(ptr);
+        __latency.push_back((uint32_t)(now_ns() - begin));
+    }
+    // 批量的延迟按每个对象平均算
+    void alloc_batch(size_t size, size_t n, void** out) {
+        uint64_t begin = now_ns();
+        __a->alloc_batch(size, n, out);
+        __latency.push_back((uint32_t)((now_ns() - begin) / n));
+        __ops += n;
+        for (size_t i = 0; i < n; i++)
+            *(char*)out[i] = 1;
+    }
+    void free_batch(void** ptrs, size_t n, size_t size) {
+        uint64_t begin = now_ns();
+        __a->free_batch(ptrs, n, size);
+        __latency.push_back((uint32_t)((now_ns() - begin) / n));
+        __ops += n;
+    }
+    void* realloc(void* ptr, size_t size) {
+        if (++__ops % LATENCY_EVERY != 0) {
+            ptr = __a->realloc(ptr, size);
+        } else {
+            uint64_t begin = now_ns();
+            ptr = __a->realloc(ptr, size);
+            __latency.push_back((uint32_t)(now_ns() - begin));
+        }
+        ((char*)ptr)[size - 1] = 1;
+        return ptr;
+    }
+};
+
+// 当前线程的cache miss计数，打不开(虚拟机里一般没有硬件计数器)的时候stop返回-1
+class cache_miss_counter {
+private:
+    int __fd = -1;
+
+public:
+    void start() {
+#if defined(__linux__)
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        __fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (__fd >= 0) {
+            ioctl(__fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(__fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    long long stop() {
+        long long value = -1;
+#if defined(__linux__)
+        if (__fd < 0)
+            return -1;
+        ioctl(__fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(__fd, &value, sizeof(value)) != sizeof(value))
+            value = -1;
+        close(__fd);
+        __fd = -1;
+#endif
+        return value;
+    }
+};
+
+class spin_barrier {
+private:
+    size_t __n;
+    std::atomic<size_t> __count;
+    std::atomic<size_t> __generation;
+
+public:
+    explicit spin_barrier(size_t n)
+        : __n(n)
+        , __count(0)
+        , __generation(0) { }
+    void wait() {
+        size_t gen = __generation.load(std::memory_order_acquire);
+        if (__count.fetch_add(1, std::memory_order_acq_rel) + 1 == __n) {
+            __count.store(0, std::memory_order_relaxed);
+            __generation.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        while (__generation.load(std::memory_order_acquire) == gen)
+            std::this_thread::yield(); // 线程数可能比核数多
+    }
+};
+
+// xmalloc的一对线程之间的单生产者单消费者队列，一个元素是一批对象
+struct batch_ring {
+    void* objs[XMALLOC_RING][XMALLOC_BATCH];
+    std::atomic<size_t> head { 0 };
+    std::atomic<size_t> tail { 0 };
+};
+
+// 一次运行里所有线程共享的东西
+struct bench_shared {
+    spin_barrier barrier;
+    std::vector<void*> larson_slots;
+    std::vector<batch_ring> rings;
+    bench_shared(size_t n)
+        : barrier(n)
+        , larson_slots(n * LARSON_SLOTS, nullptr)
+        , rings(n / 2 + 1) { }
+};
+
+// Hoard的threadtest: 每个线程反复申请一批固定大小的对象再全部释放，没有跨线程的释放
+static void threadtest(worker& w, size_t /*tid*/, size_t /*n*/, bench_shared& /*st*/) {
+    void* objs[THREADTEST_OBJS];
+    for (size_t iter = 0; iter < BENCH_OPS / 2 / THREADTEST_OBJS; iter++) {
+        for (size_t i = 0; i < THREADTEST_OBJS; i++)
+            objs[i] = w.alloc(16);
+        for (size_t i = 0; i < THREADTEST_OBJS; i++)
+            w.free(objs[i]);
     }
-    std::cout << nworks << "threads run" << rounds << " times, each round malloc " << ntimes << " times, cost: " << malloc_costtime.load() << "ms\n";
-    std::cout << nworks << "threads run" << rounds << " times, each round free " << ntimes << " times,  cost: " << free_costtime.load() << " ms\n";
-    std::cout << nworks << "threads run malloc and free " << nworks * rounds * ntimes << " time, total cost: " << malloc_costtime.load() + free_costtime.load() << " ms\n";
 }
 
-// 单轮次申请释放次数 线程数 轮次
-void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds) {
-    std::vector<std::thread> vthread(nworks);
-    std::atomic<size_t> malloc_costtime(0);
-    std::atomic<size_t> free_costtime(0);
-    for (size_t k = 0; k < nworks; ++k) {
-        vthread[k] = std::thread([&]() {
-            std::vector<void*> v;
-            v.reserve(ntimes);
-            for (size_t j = 0; j < rounds; ++j) {
-                size_t begin1 = clock();
-                for (size_t i = 0; i < ntimes; i++) {
-                    v.push_back(tcmalloc(16));
-                    // v.push_back(ConcurrentAlloc((16 + i) % 8192 + 1));
-                }
-                size_t end1 = clock();
-                size_t begin2 = clock();
-                for (size_t i = 0; i < ntimes; i++) {
-                    tcfree(v[i]);
-                }
-                size_t end2 = clock();
-                v.clear();
-                malloc_costtime += (end1 - begin1);
-                free_costtime += (end2 - begin2);
-            }
+// central: 一次申请很多个不同大小的对象再全部释放，threadCache装不下，大部分操作都要找centralCache补货和还货
+// 专门看cc和pc的批量路径(span元数据，桶锁)
+static void central(worker& w, size_t /*tid*/, size_t /*n*/, bench_shared& /*st*/) {
+    std::vector<void*> objs(CENTRAL_OBJS);
+    for (size_t iter = 0; iter < BENCH_OPS / 2 / CENTRAL_OBJS; iter++) {
+        for (size_t i = 0; i < CENTRAL_OBJS; i++)
+            objs[i] = w.alloc(16 + (i % 64) * 48);
+        for (size_t i = 0; i < CENTRAL_OBJS; i++)
+            w.free(objs[i]);
+    }
+}
+
+// batch: 和消息处理一样，一次申请/释放一组同样大小的对象，tcmalloc用批量接口
+static void batch(worker& w, size_t /*tid*/, size_t /*n*/, bench_shared& /*st*/) {
+    void* objs[BATCH_OBJS];
+    for (size_t iter = 0; iter < BENCH_OPS / 2 / BATCH_OBJS; iter++) {
+        size_t size = 16 + (iter % 16) * 16;
+        w.alloc_batch(size, BATCH_OBJS, objs);
+        w.free_batch(objs, BATCH_OBJS, size);
+    }
+}
+
+// 随机大小: 每个线程维护一个工作集，每次随机释放一个槽再申请一个随机大小的
+static void random_sizes(worker& w, size_t /*tid*/, size_t /*n*/, bench_shared& /*st*/) {
+    std::vector<void*> slots(RANDOM_SLOTS, nullptr);
+    for (size_t i = 0; i < BENCH_OPS / 2; i++) {
+        size_t k = w.next() % RANDOM_SLOTS;
+        if (slots[k] != nullptr)
+            w.free(slots[k]);
+        slots[k] = w.alloc(w.random_size());
+    }
+    for (void* ptr : slots) {
+        if (ptr != nullptr)
+            w.free(ptr);
+    }
+}
+
+// Larson: 像服务器一样，每个线程随机替换一组槽里的对象
+// 每一轮结束换到下一个线程的槽，上一轮别的线程申请的对象由这个线程释放
+static void larson(worker& w, size_t tid, size_t n, bench_shared& st) {
+    for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+        void** slots = &st.larson_slots[((tid + round) % n) * LARSON_SLOTS];
+        for (size_t i = 0; i < BENCH_OPS / 2 / LARSON_ROUNDS; i++) {
+            size_t k = w.next() % LARSON_SLOTS;
+            if (slots[k] != nullptr)
+                w.free(slots[k]);
+            slots[k] = w.alloc(16 + w.next() % 113);
+        }
+        st.barrier.wait();
+    }
+}
+
+// xmalloc: 线程两两一组，一个只申请，一个只释放，所有的释放都是跨线程的
+// 单数的最后一个线程自己申请自己释放
+static void xmalloc(worker& w, size_t tid, size_t n, bench_shared& st) {
+    size_t batches = BENCH_OPS / 2 / XMALLOC_BATCH;
+    if (tid == n - 1 && n % 2 == 1) {
+        void* objs[XMALLOC_BATCH];
+        for (size_t b = 0; b < batches; b++) {
+            for (size_t i = 0; i < XMALLOC_BATCH; i++)
+                objs[i] = w.alloc(w.random_size() % 512 + 1);
+            for (size_t i = 0; i < XMALLOC_BATCH; i++)
+                w.free(objs[i]);
+        }
+        return;
+    }
+    batch_ring& ring = st.rings[tid / 2];
+    for (size_t b = 0; b < batches * 2; b++) {
+        if (tid % 2 == 0) {
+            size_t tail = ring.tail.load(std::memory_order_relaxed);
+            while (tail - ring.head.load(std::memory_order_acquire) == XMALLOC_RING)
+                std::this_thread::yield();
+            for (size_t i = 0; i < XMALLOC_BATCH; i++)
+                ring.objs[tail % XMALLOC_RING][i] = w.alloc(w.random_size() % 512 + 1);
+            ring.tail.store(tail + 1, std::memory_order_release);
+        } else {
+            size_t head = ring.head.load(std::memory_order_relaxed);
+            while (ring.tail.load(std::memory_order_acquire) == head)
+                std::this_thread::yield();
+            for (size_t i = 0; i < XMALLOC_BATCH; i++)
+                w.free(ring.objs[head % XMALLOC_RING][i]);
+            ring.head.store(head + 1, std::memory_order_release);
+        }
+    }
+}
+
+// realloc: 一组缓冲区不停地变长(像拼接字符串)，长到REALLOC_MAX就释放掉重新开始
+static void realloc_loop(worker& w, size_t /*tid*/, size_t /*n*/, bench_shared& /*st*/) {
+    void* bufs[REALLOC_BUFS] = { nullptr };
+    size_t sizes[REALLOC_BUFS] = { 0 };
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        size_t k = w.next() % REALLOC_BUFS;
+        if (sizes[k] > REALLOC_MAX) {
+            w.free(bufs[k]);
+            bufs[k] = nullptr;
+            sizes[k] = 0;
+            continue;
+        }
+        sizes[k] += sizes[k] / 4 + 1 + w.next() % 64;
+        bufs[k] = w.realloc(bufs[k], sizes[k]);
+    }
+    for (size_t k = 0; k < REALLOC_BUFS; k++) {
+        if (bufs[k] != nullptr)
+            w.free(bufs[k]);
+    }
+}
+
+// large: 反复申请/释放几个1~8MB的缓冲区(像IO缓冲和序列化)，每一页都写一下
+// 没有缓存的话每次申请是一次mmap加上整个缓冲区的缺页，释放是一次munmap
+static void large(worker& w, size_t /*tid*/, size_t /*n*/, bench_shared& /*st*/) {
+    void* bufs[LARGE_BUFS] = { nullptr };
+    for (size_t i = 0; i < LARGE_OPS / 2; i++) {
+        size_t k = w.next() % LARGE_BUFS;
+        if (bufs[k] != nullptr)
+            w.free(bufs[k]);
+        size_t size = (1 + w.next() % 8) << 20;
+        bufs[k] = w.alloc(size);
+        for (size_t off = 0; off < size; off += 4096)
+            ((char*)bufs[k])[off] = 1;
+    }
+    for (void* ptr : bufs) {
+        if (ptr != nullptr)
+            w.free(ptr);
+    }
+}
+
+struct workload {
+    const char* name;
+    void (*run)(worker& w, size_t tid, size_t n, bench_shared& st);
+};
+
+static const workload WORKLOADS[] = {
+    { "threadtest", threadtest },
+    { "central", central },
+    { "batch", batch },
+    { "random", random_sizes },
+    { "larson", larson },
+    { "xmalloc", xmalloc },
+    { "realloc", realloc_loop },
+    { "large", large },
+};
+
+// warmup: 只跑不输出，第一次跑的时候要从系统拿页(缺页，大页清零)，不算进结果
+static void run_one(const workload& wl, const allocator& a, size_t n, bool warmup = false) {
+    bench_shared st(n);
+    std::vector<worker> workers;
+    for (size_t t = 0; t < n; t++)
+        workers.emplace_back(&a, t);
+    std::atomic<bool> go(false);
+    std::atomic<size_t> ready(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n; t++) {
+        threads.emplace_back([&, t]() {
+            ready++;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            cache_miss_counter counter;
+            counter.start();
+            wl.run(workers[t], t, n, st);
+            workers[t].__misses = counter.stop();
         });
     }
-    for (auto& t : vthread) {
+    while (ready.load() != n)
+        std::this_thread::yield();
+    uint64_t begin = now_ns();
+    go.store(true, std::memory_order_release);
+    for (auto& t : threads)
         t.join();
+    uint64_t cost = now_ns() - begin;
+    for (void* ptr : st.larson_slots) {
+        if (ptr != nullptr)
+            a.free(ptr); // larson最后留在槽里的，不计时
     }
-    std::cout << nworks << "threads run" << rounds << " times, each round malloc " << ntimes << " times, cost: " << malloc_costtime.load() << "ms\n";
-    std::cout << nworks << "threads run" << rounds << " times, each round free " << ntimes << " times,  cost: " << free_costtime.load() << " ms\n";
-    std::cout << nworks << "threads run tcmalloc and tcfree " << nworks * rounds * ntimes << " time, total cost: " << malloc_costtime.load() + free_costtime.load() << " ms\n";
+    size_t ops = 0;
+    long long misses = 0;
+    std::vector<uint32_t> latency;
+    for (auto& w : workers) {
+        ops += w.__ops;
+        misses = (misses < 0 || w.__misses < 0) ? -1 : misses + w.__misses;
+        latency.insert(latency.end(), w.__latency.begin(), w.__latency.end());
+    }
+    if (warmup)
+        return;
+    std::sort(latency.begin(), latency.end());
+    auto percentile = [&](double p) -> unsigned {
+        if (latency.empty())
+            return 0;
+        return latency[std::min(latency.size() - 1, (size_t)(p * latency.size()))];
+    };
+    char miss_per_op[32] = "-";
+    if (misses >= 0)
+        snprintf(miss_per_op, sizeof(miss_per_op), "%.3f", (double)misses / ops);
+    printf("%-12s %7zu %-10s %10.2f %9u %9u %9u %9u %9s\n", wl.name, n, a.name,
+        ops / (cost / 1000.0), percentile(0.5), percentile(0.99), percentile(0.999),
+        latency.empty() ? 0 : latency.back(), miss_per_op);
+    fflush(stdout);
 }
 
-int main() {
-    size_t n = 1000;
-    BenchmarkConcurrentMalloc(n, 4, 10);
-    std::cout << std::endl
-              << std::endl;
-    BenchmarkMalloc(n, 4, 10);
+int main(int argc, char* argv[]) {
+    size_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    if (argc > 1)
+        max_threads = std::max(atoi(argv[1]), 1);
+    std::vector<size_t> thread_counts;
+    for (size_t t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+    printf("%-12s %7s %-10s %10s %9s %9s %9s %9s %9s\n", "workload", "threads", "allocator",
+        "Mops/s", "p50(ns)", "p99(ns)", "p99.9(ns)", "max(ns)", "miss/op");
+    for (const workload& wl : WORKLOADS) {
+        bool selected = argc <= 2;
+        for (int i = 2; i < argc; i++)
+            selected = selected || strcmp(argv[i], wl.name) == 0;
+        if (!selected)
+            continue;
+        for (const allocator& a : ALLOCATORS)
+            run_one(wl, a, 1, true);
+        for (size_t n : thread_counts) {
+            for (const allocator& a : ALLOCATORS)
+                run_one(wl, a, n);
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,28 +1,104 @@
-
 #ifndef __YUFC_CENTRAL_CACHE_HPP__
 #define __YUFC_CENTRAL_CACHE_HPP__
 
 #include "./common.hpp"
+#include <atomic>
+
+static const size_t TRANSFER_SLOTS = 64; // 每个桶的transfer cache最多存多少批
+static const size_t TRANSFER_CACHE_BYTES = 512 * 1024; // 每个桶的transfer cache最多存多少字节(至少能放一整批)
+
+// centralCache前面的一层: 按批缓存threadCache还回来的对象
+// 一个线程还回来的一批对象，可以原封不动地给下一个来要的线程，不用拆回span里，也不用查radix树
+// 只用一把很小的锁，持有时间只有几条指令
+// 按cache line对齐，相邻两个桶的锁和计数不在同一行
+class alignas(CACHE_LINE_SIZE) transfer_cache {
+private:
+    // 一批对象，本身就是用对象头部串起来的链表
+    struct batch {
+        void* start;
+        void* end;
+        size_t n;
+    };
+    batch __slots[TRANSFER_SLOTS];
+    size_t __used = 0; // 用了几个slot(当栈用，后进先出，刚还回来的对象还在cache里)
+    size_t __objs = 0; // 一共存了多少个对象
+    std::mutex __mtx;
+
+public:
+    // 放一批进来，放不下返回false
+    bool insert_range(void* start, void* end, size_t n, size_t max_objs);
+    // 拿最多batch_num个出来，返回实际拿到的个数，没有返回0
+    size_t remove_range(void*& start, void*& end, size_t batch_num);
+    // 整批拿走最上面的一批，空了返回0
+    size_t pop_batch(void*& start, void*& end);
+    // 现在存了多少个对象(统计用)
+    size_t objs() {
+        std::lock_guard<std::mutex> lock(__mtx);
+        return __objs;
+    }
+};
+
+static const size_t RELEASE_GROUPS = 64; // 批量释放的时候，一次最多按多少个span分组(哈希表大小)
+
+// 一个桶的统计计数，在桶锁里面改，读的时候不用加锁
+// 单独占一个cache line: 放在按桶排的数组里的话，不同桶的线程会互相把对方的行刷掉
+struct alignas(CACHE_LINE_SIZE) central_bucket_stats {
+    std::atomic<size_t> span_bytes { 0 }; // 这个桶手里所有span的字节数
+    std::atomic<size_t> capacity_objs { 0 }; // 这些span一共切出了多少个对象
+    std::atomic<size_t> out_objs { 0 }; // 其中不在span自由链表上的(给出去了的)
+};
 
 class central_cache {
 private:
-    span_list __span_lists[BUCKETS_NUM]; // 有多少个桶就多少个
+    // 批量释放时，同一个span的对象先串成一组，加锁之后一次挂回span
+    struct span_group {
+        span* s;
+        void* head;
+        void* tail;
+        size_t n;
+    };
+
+private:
+    span_list __span_lists[BUCKETS_NUM]; // 有多少个桶就多少个，只挂还有空闲对象的span
+    span_list __full_lists[BUCKETS_NUM]; // 对象全部分出去了的span，用__span_lists[i]的桶锁保护
+    transfer_cache __transfer_caches[BUCKETS_NUM];
+    central_bucket_stats __stats[BUCKETS_NUM]; // 统计用的计数
 private:
-    static central_cache __s_inst;
     central_cache() = default; // 构造函数私有
     central_cache(const central_cache&) = delete; // 不允许拷贝
 public:
-    static central_cache* get_instance() { return &__s_inst; }
+    static central_cache* get_instance() {
+        // 第一次用的时候才构造，作为LD_PRELOAD时malloc可能在全局对象构造之前就被调用
+        static central_cache __s_inst;
+        return &__s_inst;
+    }
     // 将中心缓存获取一定数量的对象给threadCache
-    size_t fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size);
+    // owner: 要的threadCache的远程队列编号，记在span上
+    size_t fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size, size_t owner = 0);
     // 获取一个非空的span
     span* get_non_empty_span(span_list& list, size_t size);
 
 public:
     // 将一定数量的对象释放到span中
     void release_list_to_spans(void* start, size_t byte_size);
+    // 还一批[start, end]共n个对象，先尝试放进transfer cache，放不下再拆回span
+    void release_range(void* start, void* end, size_t n, size_t byte_size);
+
+    // 把所有桶的transfer cache都拆回span，空了的span还给pc，这样pc才能把页还给操作系统
+    void drain_transfer_caches();
+
+private:
+    // 把分好组的对象挂回各自的span，只加一次桶锁，空了的span一次性还给pc
+    void __release_groups(size_t index, span_group* groups);
 
 public:
+    // 第index个桶的统计: span一共多少字节，切出了多少对象，给出去了多少，transfer cache里有多少
+    void get_class_stats(size_t index, size_t& span_bytes, size_t& capacity_objs, size_t& out_objs, size_t& transfer_objs) {
+        span_bytes = __stats[index].span_bytes.load(std::memory_order_relaxed);
+        capacity_objs = __stats[index].capacity_objs.load(std::memory_order_relaxed);
+        out_objs = __stats[index].out_objs.load(std::memory_order_relaxed);
+        transfer_objs = __transfer_caches[index].objs();
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -4,8 +4,10 @@
 #define __YUFC_COMM_HPP__
 
 #include <algorithm>
+#include <atomic>
 #include <assert.h>
 #include <mutex>
+#include <stdint.h>
 #include <unordered_map>
 
 #ifdef PROJECT_DEBUG
@@ -15,16 +17,19 @@
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
-#elif defined(__aarch64__) // ...
+#elif defined(__linux__) // x86_64 / aarch64 / arm
 #include <sys/mman.h>
 #else
 #include <iostream>
 #endif
 
 static const size_t MAX_BYTES = 256 * 1024; // 256kb
-static const size_t BUCKETS_NUM = 208; // 一共208个桶
 static const size_t PAGES_NUM = 129; // pageCahche设置128个桶
 static const size_t PAGE_SHIFT = 13;
+static const size_t HUGEPAGE_SHIFT = 21; // 2MB透明大页
+static const size_t HUGEPAGE_SIZE = (size_t)1 << HUGEPAGE_SHIFT;
+static const size_t HUGEPAGE_PAGES = HUGEPAGE_SIZE >> PAGE_SHIFT; // 一个大页有256个页
+static const size_t CACHE_LINE_SIZE = 64;
 
 #if defined(_WIN64) || defined(__x86_64__) || defined(__ppc64__) || defined(__aarch64__)
 typedef unsigned long long PAGE_ID;
@@ -34,30 +39,276 @@ typedef size_t PAGE_ID;
 #define SYS_BYTES 32
 #endif
 
-inline static void* system_alloc(size_t kpage) {
+#if SYS_BYTES == 64
+// x86_64/aarch64 用户态虚拟地址只有48位，radix树只需要覆盖这么多页号
+static const int PAGE_MAP_BITS = 48 - PAGE_SHIFT;
+#else
+static const int PAGE_MAP_BITS = 32 - PAGE_SHIFT;
+#endif
+
+#if defined(__linux__)
+#if SYS_BYTES == 64
+static const size_t REGION_RESERVE_BYTES = (size_t)1 << 30; // 一次预留1GB的虚拟地址空间
+static const size_t SAMPLED_REGION_BYTES = (size_t)16 << 30; // 采样对象专用的地址空间，用完了就不采样了
+#else
+static const size_t REGION_RESERVE_BYTES = (size_t)64 << 20; // 32位地址空间小，一次预留64MB
+static const size_t SAMPLED_REGION_BYTES = (size_t)16 << 20;
+#endif
+static const size_t REGION_COMMIT_BYTES = HUGEPAGE_SIZE; // 每次至少提交一个大页，减少mprotect的次数
+static const size_t REGION_FREE_EXTENTS = 256; // 还回来的地址段最多记这么多段，记不下的直接munmap
+
+// linux下的页后端
+// 先用PROT_NONE预留一大段虚拟地址，page_cache要内存的时候再按需提交(mprotect成可读写)
+// 这样pc补充页的时候大部分情况下不需要系统调用，而且拿到的内存在地址上是连续的
+// 还回来的地址段(release)先madvise掉物理页，再记下来给下一次commit用，地址空间不会越用越多
+class system_region {
+private:
+    struct extent {
+        char* start;
+        size_t len;
+    };
+    char* __cur = nullptr; // 已经分出去的边界
+    char* __committed = nullptr; // 已经提交(可读写)的边界
+    char* __end = nullptr; // 预留区域的结束
+    extent __free[REGION_FREE_EXTENTS]; // 还回来的地址段(都是提交过的)，按地址排好序，相邻的合并成一段
+    size_t __nfree = 0;
+    std::mutex __region_mtx;
+    bool __fixed = false; // 只预留一次，用完了不再预留新的
+    std::atomic<uintptr_t> __lo { 0 }; // __fixed的时候记一下整个区域的范围，不加锁判断地址在不在里面
+    std::atomic<uintptr_t> __hi { 0 };
+
+private:
+    explicit system_region(bool fixed = false)
+        : __fixed(fixed) { }
+    system_region(const system_region&) = delete;
+
+public:
+    static system_region* get_instance() {
+        static system_region inst; // inline函数里的static，所有编译单元共用一份
+        return &inst;
+    }
+    // 被采样的对象单独放在一段固定的地址里，释放的时候比较一下地址就知道是不是采样的对象
+    static system_region* sampled_instance() {
+        static system_region inst(true);
+        return &inst;
+    }
+    // 只对__fixed的区域有用
+    bool contains(const void* ptr) const {
+        uintptr_t lo = __lo.load(std::memory_order_acquire); // __lo最后写，读到了__lo就一定能读到__hi
+        if (lo == 0)
+            return false;
+        return (uintptr_t)ptr - lo < __hi.load(std::memory_order_relaxed) - lo;
+    }
+    // 从预留区域切kpage页出来，必要时提交更多的页，失败返回nullptr
+    // 返回的地址按align对齐(2的幂，至少一页)，跳过的地址空间没有碰过，不占物理内存
+    void* commit(size_t kpage, size_t align) {
+        std::lock_guard<std::mutex> lock(__region_mtx);
+        size_t bytes = kpage << PAGE_SHIFT;
+        void* reused = __take_free(bytes, align);
+        if (reused != nullptr)
+            return reused;
+        size_t pad = __align_pad(__cur, align);
+        if (bytes + pad > (size_t)(__end - __cur)) {
+            if (__fixed && __end != nullptr)
+                return nullptr;
+            if (!__reserve(bytes + (align > HUGEPAGE_SIZE ? align : 0)))
+                return nullptr;
+            pad = __align_pad(__cur, align); // 新区域本身是2MB对齐的
+        }
+        char* ptr = __cur + pad;
+        if (ptr + bytes > __committed) {
+            size_t need = ptr + bytes - __committed;
+            need = (need + REGION_COMMIT_BYTES - 1) & ~(REGION_COMMIT_BYTES - 1);
+            need = std::min(need, (size_t)(__end - __committed));
+            if (mprotect(__committed, need, PROT_READ | PROT_WRITE) != 0)
+                return nullptr;
+#ifdef MADV_HUGEPAGE
+            // __committed一直是2MB对齐的，每次提交的都是完整的大页，让内核尽量用透明大页
+            madvise(__committed, need, MADV_HUGEPAGE);
+#endif
+            __committed += need;
+        }
+        __cur = ptr + bytes;
+        return ptr;
+    }
+    // 把commit出去的[ptr, ptr + bytes)还回来: 物理页马上还给操作系统，地址段留着下次commit再用
+    void release(void* ptr, size_t bytes) {
+        madvise(ptr, bytes, MADV_DONTNEED);
+        std::lock_guard<std::mutex> lock(__region_mtx);
+        char* p = (char*)ptr;
+        if (p + bytes == __cur) {
+            // 正好是最后切出去的一段，边界直接退回去，前面挨着的空闲段也一起退
+            __cur = p;
+            for (size_t i = 0; i < __nfree; i++) {
+                if (__free[i].start + __free[i].len == __cur) {
+                    __cur = __free[i].start;
+                    for (size_t j = i; j + 1 < __nfree; j++)
+                        __free[j] = __free[j + 1];
+                    --__nfree;
+                    break;
+                }
+            }
+            return;
+        }
+        __insert_free(p, bytes);
+    }
+
+private:
+    // 在还回来的地址段里找能放下bytes(按align对齐)的最小的一段，切出来，找不到返回nullptr
+    void* __take_free(size_t bytes, size_t align) {
+        size_t best = REGION_FREE_EXTENTS;
+        for (size_t i = 0; i < __nfree; i++) {
+            size_t pad = __align_pad(__free[i].start, align);
+            if (pad + bytes <= __free[i].len && (best == REGION_FREE_EXTENTS || __free[i].len < __free[best].len))
+                best = i;
+        }
+        if (best == REGION_FREE_EXTENTS)
+            return nullptr;
+        extent e = __free[best];
+        char* ptr = e.start + __align_pad(e.start, align);
+        // 拿走中间的一段，前后剩下的还在表里
+        for (size_t i = best; i + 1 < __nfree; i++)
+            __free[i] = __free[i + 1];
+        --__nfree;
+        if (ptr != e.start)
+            __insert_free(e.start, ptr - e.start);
+        if (ptr + bytes != e.start + e.len)
+            __insert_free(ptr + bytes, e.start + e.len - (ptr + bytes));
+        return ptr;
+    }
+    // 按地址插进空闲表，和前后相邻的合并，表满了就直接munmap(这段地址以后不用了)
+    void __insert_free(char* p, size_t len) {
+        size_t i = 0;
+        while (i < __nfree && __free[i].start < p)
+            i++;
+        bool merge_prev = i > 0 && __free[i - 1].start + __free[i - 1].len == p;
+        bool merge_next = i < __nfree && p + len == __free[i].start;
+        if (merge_prev && merge_next) {
+            __free[i - 1].len += len + __free[i].len;
+            for (size_t j = i; j + 1 < __nfree; j++)
+                __free[j] = __free[j + 1];
+            --__nfree;
+        } else if (merge_prev) {
+            __free[i - 1].len += len;
+        } else if (merge_next) {
+            __free[i].start = p;
+            __free[i].len += len;
+        } else if (__nfree < REGION_FREE_EXTENTS) {
+            for (size_t j = __nfree; j > i; j--)
+                __free[j] = __free[j - 1];
+            __free[i] = { p, len };
+            ++__nfree;
+        } else {
+            munmap(p, len);
+        }
+    }
+    static size_t __align_pad(char* p, size_t align) {
+        return (align - ((uintptr_t)p & (align - 1))) & (align - 1);
+    }
+    // 预留一块新的区域
+    // 旧区域剩下的尾巴: 提交过的部分放进空闲表以后接着用，没提交过的还给操作系统
+    bool __reserve(size_t bytes) {
+        size_t len = std::max(bytes, __fixed ? SAMPLED_REGION_BYTES : REGION_RESERVE_BYTES);
+        len = (len + REGION_COMMIT_BYTES - 1) & ~(REGION_COMMIT_BYTES - 1);
+        // mmap只保证4KB对齐，多要一个大页用来对齐到2MB，大页才能完整地落在我们的页上
+        void* p = mmap(NULL, len + HUGEPAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return false;
+        char* base = (char*)p + __align_pad((char*)p, HUGEPAGE_SIZE);
+        // 对齐多出来的头尾还回去
+        if (base != (char*)p)
+            munmap(p, base - (char*)p);
+        size_t tail = (char*)p + len + HUGEPAGE_SIZE - (base + len);
+        if (tail != 0)
+            munmap(base + len, tail);
+        if (__cur != __committed)
+            __insert_free(__cur, __committed - __cur);
+        if (__committed != __end)
+            munmap(__committed, __end - __committed);
+        __cur = __committed = base;
+        __end = base + len;
+        if (__fixed) {
+            __hi.store((uintptr_t)__end, std::memory_order_relaxed);
+            __lo.store((uintptr_t)base, std::memory_order_release);
+        }
+        return true;
+    }
+};
+#endif
+
+// 从操作系统拿了多少内存，都是原子计数，统计的时候不用加锁
+class system_stats {
+private:
+    std::atomic<size_t> __system_bytes { 0 }; // 从系统要的(包括已经madvise还回去的页)
+    std::atomic<size_t> __metadata_bytes { 0 }; // 其中给元数据(span对象，radix树，threadCache对象等)用的
+
+private:
+    system_stats() = default;
+    system_stats(const system_stats&) = delete;
+
+public:
+    static system_stats* get_instance() {
+        static system_stats inst;
+        return &inst;
+    }
+    void add_system(size_t bytes) { __system_bytes.fetch_add(bytes, std::memory_order_relaxed); }
+    void sub_system(size_t bytes) { __system_bytes.fetch_sub(bytes, std::memory_order_relaxed); }
+    void add_metadata(size_t bytes) { __metadata_bytes.fetch_add(bytes, std::memory_order_relaxed); }
+    size_t system_bytes() const { return __system_bytes.load(std::memory_order_relaxed); }
+    size_t metadata_bytes() const { return __metadata_bytes.load(std::memory_order_relaxed); }
+};
+
+// 找系统要kpage页，地址按align对齐(2的幂，默认一页)
+inline static void* system_alloc(size_t kpage, size_t align = (size_t)1 << PAGE_SHIFT) {
     void* ptr = nullptr;
 #if defined(_WIN32) || defined(_WIN64)
     ptr = VirtualAlloc(0, kpage << 13, MEM_COMMIT | MEM_RESERVE,
         PAGE_READWRITE);
-#elif defined(__aarch64__) // ...
-    ptr = mmap(NULL, kpage << 13, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr != nullptr && ((uintptr_t)ptr & (align - 1)) != 0) {
+        // VirtualAlloc只保证64KB对齐: 先多占一段地址找到对齐的位置，放掉之后在这个位置上重新要
+        VirtualFree(ptr, 0, MEM_RELEASE);
+        ptr = nullptr;
+        for (int retry = 0; retry < 8 && ptr == nullptr; retry++) {
+            char* p = (char*)VirtualAlloc(0, (kpage << 13) + align, MEM_RESERVE, PAGE_NOACCESS);
+            if (p == nullptr)
+                break;
+            char* aligned = (char*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+            VirtualFree(p, 0, MEM_RELEASE);
+            ptr = VirtualAlloc(aligned, kpage << 13, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE); // 被别的线程抢走了就再来一次
+        }
+    }
+#elif defined(__linux__) // ...
+    ptr = system_region::get_instance()->commit(kpage, align);
 #else
     std::cerr << "unknown system" << std::endl;
     throw std::bad_alloc();
 #endif
     if (ptr == nullptr)
         throw std::bad_alloc();
+    system_stats::get_instance()->add_system(kpage << PAGE_SHIFT);
     return ptr;
 }
 
 inline static void system_free(void* ptr, size_t size = 0) {
     /**
-     * linux的munmap需要给大小
+     * linux下还给region需要给大小
      */
 #if defined(_WIN32) || defined(_WIN64)
     VirtualFree(ptr, 0, MEM_RELEASE);
 #elif defined(__linux__) // ...
-    munmap(ptr, size);
+    // 地址段还给region，下次commit的时候再用，不然region只会往后切，地址空间和radix树的节点都会越用越多
+    system_region::get_instance()->release(ptr, size);
+#endif
+    system_stats::get_instance()->sub_system(size);
+}
+
+// 把页还给操作系统(RSS降下来)，但是地址空间还留着，以后还可以直接用
+// linux下再次访问的时候内核会给一个清零的新页
+inline static void system_release(void* ptr, size_t bytes) {
+#if defined(_WIN32) || defined(_WIN64)
+    VirtualAlloc(ptr, bytes, MEM_RESET, PAGE_READWRITE);
+#elif defined(__linux__) // ...
+    madvise(ptr, bytes, MADV_DONTNEED);
 #endif
 }
 
@@ -66,25 +317,28 @@ class free_list {
 private:
     void* __free_list_ptr = nullptr;
     size_t __max_size = 1;
-    size_t __size = 0;
+    // 只有主人线程会改，统计的时候别的线程会读，所以用原子变量(relaxed的读写和普通变量一样快)
+    std::atomic<size_t> __size { 0 };
+    size_t __low_water = 0; // 上次清零之后链表最短的时候有多长，一直不是0说明这么多对象一直闲着
+    size_t __overages = 0; // 链表连续涨到上限的次数
 
 public:
     void push(void* obj) {
         assert(obj);
         __next_obj(obj) = __free_list_ptr;
         __free_list_ptr = obj;
-        ++__size;
+        __set_size(size() + 1);
     }
     void push(void* start, void* end, size_t n) {
         __next_obj(end) = __free_list_ptr;
         __free_list_ptr = start;
-        __size += n;
+        __set_size(size() + n);
     }
     void* pop() {
         assert(__free_list_ptr);
         void* obj = __free_list_ptr;
         __free_list_ptr = __next_obj(obj);
-        --__size;
+        __set_size(size() - 1);
         return obj;
     }
     void pop(void*& start, void*& end, size_t n) {
@@ -92,18 +346,40 @@ public:
 #ifdef PROJECT_DEBUG
         LOG(DEBUG) << "call here" << std::endl;
 #endif
-        assert(n <= __size);
+        assert(n <= size());
         start = __free_list_ptr;
         end = start; // debug 20240507 miss this
         for (size_t i = 0; i < n - 1; i++)
             end = free_list::__next_obj(end);
         __free_list_ptr = free_list::__next_obj(end);
         free_list::__next_obj(end) = nullptr;
-        __size -= n;
+        __set_size(size() - n);
+    }
+    // 拿最多n个放进out数组，返回实际拿到的个数
+    size_t pop_batch(void** out, size_t n) {
+        size_t i = 0;
+        while (i < n && __free_list_ptr != nullptr) {
+            out[i++] = __free_list_ptr;
+            __free_list_ptr = __next_obj(__free_list_ptr);
+        }
+        __set_size(size() - i);
+        return i;
     }
     bool empty() { return __free_list_ptr == nullptr; }
+    void* front() { return __free_list_ptr; }
     size_t& max_size() { return __max_size; }
-    size_t size() { return __size; }
+    size_t size() const { return __size.load(std::memory_order_relaxed); }
+    size_t& overages() { return __overages; }
+    size_t low_water() { return __low_water; }
+    void clear_low_water() { __low_water = size(); }
+
+private:
+    // 只会变短的时候更新low water
+    void __set_size(size_t n) {
+        if (n < __low_water)
+            __low_water = n;
+        __size.store(n, std::memory_order_relaxed);
+    }
 
 public:
     static void*& __next_obj(void* obj) {
@@ -112,58 +388,86 @@ public:
 };
 
 // 计算对象大小的对齐映射规则
+// size class表: 每个桶里面对象的大小，编译期生成
+// 相邻两个size class最多差1/2^CLASS_WASTE_SHIFT，所以内碎片不超过12.5%(再加上对齐)
+// 1KB以内的size class是8的倍数，以上是128的倍数，这样查表的时候1KB以内按8字节一格，以上按128字节一格
+static const size_t CLASS_WASTE_SHIFT = 3;
+static const size_t SMALL_LOOKUP_MAX = 1024;
+
+constexpr size_t __class_align(size_t size) {
+    return size <= 128 ? 8 : (size <= SMALL_LOOKUP_MAX ? 16 : 128);
+}
+constexpr size_t __next_class_size(size_t size) {
+    size_t align = __class_align(size);
+    size_t step = std::max(align, (size >> CLASS_WASTE_SHIFT) & ~(align - 1));
+    size_t next = size + step;
+    align = __class_align(next); // 跨过1KB之后要按128对齐
+    next = (next + align - 1) & ~(align - 1);
+    return next > MAX_BYTES ? MAX_BYTES : next;
+}
+constexpr size_t __count_classes() {
+    size_t n = 1;
+    for (size_t size = 8; size < MAX_BYTES; size = __next_class_size(size))
+        n++;
+    return n;
+}
+static const size_t BUCKETS_NUM = __count_classes(); // 桶的个数就是size class的个数
+// 对象大小 -> 查表的下标
+constexpr size_t __class_array_index(size_t bytes) {
+    return bytes <= SMALL_LOOKUP_MAX ? (bytes + 7) >> 3 : (bytes + 127 + (120 << 7)) >> 7;
+}
+static const size_t CLASS_ARRAY_SIZE = __class_array_index(MAX_BYTES) + 1;
+static_assert(BUCKETS_NUM <= 256, "size class index must fit in uint8_t");
+
+struct size_class_table {
+    size_t sizes[BUCKETS_NUM] = {}; // 第i个桶的对象大小
+    uint8_t index[CLASS_ARRAY_SIZE] = {}; // 查表下标 -> 第几个桶
+    constexpr size_class_table() {
+        size_t size = 8;
+        for (size_t i = 0; i < BUCKETS_NUM; i++) {
+            sizes[i] = size;
+            size = __next_class_size(size);
+        }
+        size_t cls = 0;
+        for (size_t i = 0; i < CLASS_ARRAY_SIZE; i++) {
+            // 这一格里最大的大小，找第一个装得下它的size class
+            size_t max_size = i <= (SMALL_LOOKUP_MAX >> 3) ? i << 3 : (i - 120) << 7;
+            while (sizes[cls] < max_size)
+                cls++;
+            index[i] = (uint8_t)cls;
+        }
+    }
+};
+static constexpr size_class_table SIZE_CLASSES = size_class_table();
+
 class size_class {
 public:
     static inline size_t __round_up(size_t bytes, size_t align_number) {
         return (((bytes) + align_number - 1) & ~(align_number - 1));
     }
     static inline size_t round_up(size_t size) {
-        if (size <= 128)
-            return __round_up(size, 8);
-        else if (size <= 1024)
-            return __round_up(size, 16);
-        else if (size <= 8 * 1024)
-            return __round_up(size, 128);
-        else if (size <= 64 * 1024)
-            return __round_up(size, 1024);
-        else if (size <= 256 * 1024)
-            return __round_up(size, 8 * 1024);
-        else {
-            // 大内存
-            return __round_up(size, 1 << PAGE_SHIFT);
-        }
-    }
-    // 计算映射的哪一个自由链表桶
-    static inline size_t __bucket_index(size_t bytes, size_t align_shift) {
-        return ((bytes + (1 << align_shift) - 1) >> align_shift) - 1;
-        /*
-            这个还是同一道理，bytes不是对齐数的倍数，那就是直接模就行了
-            如果是，那就特殊规则一下即可，比如 1~128字节，对齐数字是8
-            那就是 bytes / 8 + 1 就是几号桶了
-            如果 bytes % 8 == 0 表示没有余数，刚好就是那个桶，就不用+1
-            这个也很好理解
-            当然这里的 align_shift 也不是对齐数，这种写法给的是 2^n = 对齐数，给的是这个n
-        */
+        if (size <= MAX_BYTES)
+            return SIZE_CLASSES.sizes[bucket_index(size)];
+        // 大内存
+        return __round_up(size, 1 << PAGE_SHIFT);
     }
+    // 计算映射的哪一个自由链表桶，查一次表就行
     static inline size_t bucket_index(size_t bytes) {
         assert(bytes <= MAX_BYTES);
-        // 每个区间有多少个链
-        static int group_array[4] = { 16, 56, 56, 56 };
-        if (bytes <= 128) {
-            return __bucket_index(bytes, 3);
-        } else if (bytes <= 1024) {
-            return __bucket_index(bytes - 128, 4) + group_array[0];
-        } else if (bytes <= 8 * 1024) {
-            return __bucket_index(bytes - 1024, 7) + group_array[1] + group_array[0];
-        } else if (bytes <= 64 * 1024) {
-            return __bucket_index(bytes - 8 * 1024, 10) + group_array[2] + group_array[1]
-                + group_array[0];
-        } else if (bytes <= 256 * 1024) {
-            return __bucket_index(bytes - 64 * 1024, 13) + group_array[3] + group_array[2] + group_array[1] + group_array[0];
-        } else {
-            assert(false);
-        }
-        return -1;
+        return SIZE_CLASSES.index[__class_array_index(bytes)];
+    }
+    // 对象是从页的开头按大小一个个切的，size class是align的倍数才能保证对齐
+    // 返回能保证align对齐(align不超过一页)的最小大小
+    static inline size_t aligned_round_up(size_t size, size_t align) {
+        size = __round_up(size, align);
+        while (size <= MAX_BYTES && round_up(size) % align != 0)
+            size = __round_up(round_up(size) + 1, align);
+        return size;
+    }
+    // bucket_index反过来: 第index个桶里面对象的大小
+    static inline size_t bucket_size(size_t index) {
+        assert(index < BUCKETS_NUM);
+        return SIZE_CLASSES.sizes[index];
     }
     // 一次threadCache从centralCache获取多少个内存
     static inline size_t num_move_size(size_t size) {
@@ -182,31 +486,37 @@ public:
     // 计算一次向pc获取几个页
     static inline size_t num_move_page(size_t size) {
         size_t num = num_move_size(size);
-        size_t npage = num * size;
-        npage >>= PAGE_SHIFT; // 相当于 /= 8kb
-        if (npage == 0)
-            npage = 1;
-        return npage;
+        // 向上取整，保证一个span至少装得下num个对象，尾巴上浪费的不超过一页
+        return __round_up(num * size, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
     }
 };
 
 // 管理大块内存
-class span {
+// 正好一个cache line: cc补货和还货的时候最常用的字段放在最前面，窄的字段挤在最后
+// object_pool按cache line切，每个span单独占一行，不会和别的span共用
+class alignas(CACHE_LINE_SIZE) span {
 public:
-    PAGE_ID __page_id; // 大块内存起始页的页号
-    size_t __n = 0; // 页的数量
+    void* __free_list = nullptr; // 切好的小块内存的自由链表
     // 双向链表结构
     span* __next = nullptr;
     span* __prev = nullptr;
-    size_t __use_count = 0; // 切成段小块内存，被分配给threadCache的计数器
-    void* __free_list = nullptr; // 切好的小块内存的自由链表
+    PAGE_ID __page_id; // 大块内存起始页的页号
+    size_t __n = 0; // 页的数量
+    size_t __obj_size; // 切好的小对象的大小(大内存是申请的大小，可能超过4GB)
+    uint32_t __use_count = 0; // 切成段小块内存，被分配给threadCache的计数器
+    uint16_t __owner = 0; // 最后一个从这里拿对象的threadCache的远程队列编号，0表示没有，别的线程跨线程释放的时候按这个还
+    uint8_t __shard = 0; // 属于pageCache的哪个分片(从1开始)
     bool __is_use = false; // 是否在被使用
-    size_t __obj_size; // 切好的小对象的大小
+    uint32_t __returned_n = 0; // 空闲的时候，有多少页已经还给操作系统了(和常驻的页合并之后可能只还了一部分)
 };
+static_assert(sizeof(span) == CACHE_LINE_SIZE, "span should fit in one cache line");
 
 // 带头双向循环链表
+// span对齐到cache line，span_list也就跟着对齐了(哨兵一行，头指针和桶锁一行)
+// 放在数组里的时候，每个桶的锁不会和隔壁桶挤在同一行，一个桶加锁解锁不会把别的桶的行刷掉
 class span_list {
 private:
+    span __head_node;
     span* __head = nullptr;
 
 public:
@@ -214,7 +524,7 @@ public:
 
 public:
     span_list() {
-        __head = new span;
+        __head = &__head_node; // 哨兵头结点直接放在对象里面，不用new
         __head->__next = __head;
         __head->__prev = __head;
     }
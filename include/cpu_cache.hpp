@@ -0,0 +1,70 @@
+
+#ifndef __YUFC_CPU_CACHE_HPP__
+#define __YUFC_CPU_CACHE_HPP__
+
+#include "./common.hpp"
+#include <atomic>
+
+// 每个CPU的缓存，可以替代每个线程的threadCache
+// 线程数远大于核数的时候，threadCache的总内存是跟着线程数涨的，而cpuCache只跟核数有关
+// 用linux的rseq(restartable sequences)保证在当前CPU上的push/pop是原子的，不需要加锁:
+//      临界区执行到一半被抢占或者迁移到别的CPU，内核会让它从头再来
+// 只有x86_64 + glibc2.35以上(glibc会帮每个线程注册rseq)才能用
+// 默认不开，设置环境变量 TCMALLOC_PER_CPU_CACHES=1 打开，rseq不可用的时候还是用threadCache
+
+static const size_t MAX_CPUS = 256; // 支持的最大CPU编号，再大就直接走centralCache
+static const size_t PER_CPU_CLASS_BYTES = 64 * 1024; // 每个CPU每个桶最多缓存多少字节
+
+class cpu_cache {
+private:
+    // 每个CPU一块区域: 前面是BUCKETS_NUM个header，后面是所有桶的指针数组
+    // header.current是当前缓存了几个对象，header.end是这个桶的容量(0表示这个CPU还没初始化)
+    struct slab_header {
+        uint32_t current;
+        uint32_t end;
+    };
+    char* __region = nullptr; // __num_cpus个CPU的区域连在一起
+    size_t __num_cpus = 0; // 这台机器最多可能有几个CPU(不超过MAX_CPUS)，只给这么多CPU留区域
+    size_t __region_size = 0; // 每个CPU区域的大小
+    size_t __slot_begin[BUCKETS_NUM]; // 每个桶的指针数组在区域里的起始下标(以指针为单位，包括header)
+    uint32_t __capacity[BUCKETS_NUM]; // 每个桶的容量
+    std::atomic<int> __active { -1 }; // -1: 还没检查过 0: 不可用 1: 可用
+    std::mutex __init_mtx;
+
+private:
+    cpu_cache() = default;
+    cpu_cache(const cpu_cache&) = delete;
+
+public:
+    static cpu_cache* get_instance() {
+        static cpu_cache __s_inst;
+        return &__s_inst;
+    }
+    // 是否使用cpuCache
+    bool active() {
+        if (__active < 0)
+            __init();
+        return __active == 1;
+    }
+    // 和threadCache一样的接口
+    void* allocate(size_t size);
+    void deallocate(void* ptr, size_t size);
+    // 所有CPU每个桶里缓存了多少个对象(加到objs上)，返回一共缓存的字节数，近似值
+    size_t get_stats(size_t* objs);
+
+private:
+    void __init();
+    // 第一次在这个CPU上用的时候初始化它的区域，已经初始化过的不拿锁直接返回
+    void __init_cpu(size_t cpu);
+    // 当前CPU上的rseq临界区，失败(桶空/桶满/CPU没初始化)返回nullptr/false
+    void* __pop(size_t index);
+    bool __push(size_t index, void* ptr);
+    // 慢路径
+    void* __refill(size_t index, size_t size);
+    void __drain(size_t index, void* ptr, size_t size);
+    static size_t __current_cpu();
+    // 机器上最多可能有几个CPU，读不到就按MAX_CPUS算
+    static size_t __possible_cpus();
+};
+
+#endif
@@ -9,8 +9,58 @@
 
 #define __DEFAULT_KB__ 128
 
+static const size_t METADATA_ALIGN = CACHE_LINE_SIZE; // metadata_arena切出来的每一块都按cache line对齐
 
+// 元数据(span对象，radix树节点，threadCache对象，采样记录)的内存都从这里切
+// 一次向系统要一个完整的大页，切完了再要，从来不还
+// 元数据集中在自己的大页里，不会夹在pc的大页中间，也不用每个object_pool各自去拿region的锁
+// 所有object_pool共用这一个，所以自己带锁
+class metadata_arena {
+private:
+    char* __cur = nullptr;
+    size_t __remain = 0;
+    std::mutex __mtx;
+
+private:
+    metadata_arena() = default;
+    metadata_arena(const metadata_arena&) = delete;
+
+public:
+    static metadata_arena* get_instance() {
+        static metadata_arena inst; // inline函数里的static，所有编译单元共用一份
+        return &inst;
+    }
+    void* alloc(size_t bytes) {
+        bytes = size_class::__round_up(bytes, METADATA_ALIGN);
+        if (bytes > HUGEPAGE_SIZE / 4) {
+            // 太大了，切的话一个大页剩下的部分就浪费了，直接要页
+            size_t kpage = size_class::__round_up(bytes, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+            void* ptr = system_alloc(kpage);
+            system_stats::get_instance()->add_metadata(kpage << PAGE_SHIFT);
+            return ptr;
+        }
+        std::lock_guard<std::mutex> lock(__mtx);
+        if (__remain < bytes) {
+            // 直接找系统要页，不能走malloc: 作为LD_PRELOAD替换libc的时候malloc就是我们自己
+            __cur = (char*)system_alloc(HUGEPAGE_PAGES, HUGEPAGE_SIZE);
+            __remain = HUGEPAGE_SIZE;
+            system_stats::get_instance()->add_metadata(HUGEPAGE_SIZE);
+        }
+        void* ptr = __cur;
+        __cur += bytes;
+        __remain -= bytes;
+        return ptr;
+    }
+    // 当前这个大页还没切出去的部分(没碰过，不占物理内存)，统计用
+    size_t unused_bytes() {
+        std::lock_guard<std::mutex> lock(__mtx);
+        return __remain;
+    }
+};
 
+// 定长对象池，一块一块地从metadata_arena拿
+// 自由链表不带锁，由使用者所在的锁保护(一个锁域一个池):
+//  每个pc分片的span池 -> __page_mtx，radix树的节点池 -> __map_mtx，threadCache池 -> tc_mtx，采样记录 -> 采样器的锁
 template <class T>
 class object_pool {
 private:
@@ -26,15 +76,13 @@ public:
             void* next = *((void**)__free_list);
             obj = (T*)__free_list;
             __free_list = next;
+            new (obj) T; // 还回来的时候已经析构过了，头上还写着链表指针，要重新构造
             return obj;
         }
         if (__remain_bytes < sizeof(T)) {
             // 空间不够了，要重新开一个空间
-            __remain_bytes = __DEFAULT_KB__ * 1024;
-            __memory = (char*)malloc(__remain_bytes);
-            if (__memory == nullptr) {
-                throw std::bad_alloc();
-            }
+            __remain_bytes = std::max((size_t)__DEFAULT_KB__ * 1024, size_class::__round_up(sizeof(T), 1 << PAGE_SHIFT));
+            __memory = (char*)metadata_arena::get_instance()->alloc(__remain_bytes);
         }
         obj = (T*)__memory;
         size_t obj_size = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
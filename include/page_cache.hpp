@@ -1,34 +1,198 @@
 
-
 #ifndef __YUFC_PAGE_CACHE_HPP__
 #define __YUFC_PAGE_CACHE_HPP__
 
 #include "./common.hpp"
 #include "./object_pool.hpp"
 #include "./page_map.hpp"
+#include <atomic>
 
-class page_cache {
+static const size_t PAGE_SHARDS = 8; // pageCache拆成几个分片
+static const size_t SAMPLED_HEAP = PAGE_SHARDS; // 最后再多一个分片专门给被采样的对象用
+static const size_t DEFAULT_RELEASE_RATE = 1; // 默认每释放1000页空闲页，还1页给操作系统
+static const long long RELEASE_DELAY_PAGES = 1 << 12; // 没东西可还或者关掉了，隔这么多页再检查一次
+static const long long MAX_RELEASE_DELAY_PAGES = 1 << 14;
+static const size_t HUGEPAGE_SCAN_LIMIT = 32; // 挑span的时候最多看多少个，避免链表很长的时候太慢
+static const size_t LARGE_CACHE_BYTES = 64 * 1024 * 1024; // 大span缓存最多放这么多
+static const size_t LARGE_CACHE_MAX_SPAN_BYTES = LARGE_CACHE_BYTES / 4; // 比这个还大的不缓存
+static const size_t LARGE_CACHE_BUCKETS = 8; // 按页数的log2分桶，第0个桶是128~255页
+static const uint32_t LARGE_CACHE_IDLE_MS = 1000; // 在缓存里闲了这么久就还给操作系统
+
+typedef TCMalloc_PageMap3<PAGE_MAP_BITS> id_span_map;
+
+// 大span缓存: 大于128页的大内存释放之后先放在这里，下次申请差不多大的直接拿，不用munmap/mmap
+// 所有分片共用一个，自己带锁(在分片的锁里面拿，不会反过来拿分片的锁)
+// 只记页号和页数，span对象还给原来的分片，拿出去的时候再由新的分片造一个，所以可以跨分片复用
+class large_span_cache {
 private:
-    span_list __span_lists[PAGES_NUM];
-    static page_cache __s_inst;
-    page_cache() = default;
-    page_cache(const page_cache&) = delete;
-    // std::unordered_map<PAGE_ID, span*> __id_span_map;
-    TCMalloc_PageMap3<SYS_BYTES - PAGE_SHIFT> __id_span_map;
+    struct entry {
+        PAGE_ID page_id = 0;
+        size_t n = 0;
+        uint32_t free_time = 0; // 放进来的时间(毫秒)
+        entry* prev = nullptr;
+        entry* next = nullptr;
+    };
+    entry __buckets[LARGE_CACHE_BUCKETS]; // 每个桶一个哨兵，新放进来的在前面，尾巴上是最老的
+    size_t __cached_pages = 0;
+    uint32_t __check_time = 0; // 上次检查有没有闲太久的
+    object_pool<entry> __entry_pool;
+    std::mutex __mtx;
+
+public:
+    large_span_cache();
+    // 最佳适配: 找能装下k页的最小的一段，多出来的超过1/8就切掉，找到了返回true，n是实际给出去的页数
+    bool pop(size_t k, PAGE_ID& id, size_t& n);
+    // 放进缓存(和相邻的合并)，太大了不缓存返回false，由调用者还给操作系统；满了先把最老的还给操作系统
+    bool push(PAGE_ID id, size_t n);
+    // 从最老的开始还给操作系统，直到还了至少pages页，返回实际还了多少页
+    size_t release(size_t pages);
+    // 把闲了超过LARGE_CACHE_IDLE_MS的还给操作系统，返回还了多少页
+    size_t release_idle();
+    size_t cached_pages();
+
+private:
+    void __insert(entry* e);
+    void __unlink(entry* e);
+    // 把最老的那一段还给操作系统，返回还了多少页，调用前要加锁
+    size_t __evict_oldest();
+    // 隔一段时间检查一次，闲太久的还给操作系统，调用前要加锁
+    void __age(uint32_t now, bool force = false);
+    static size_t __bucket(size_t n) {
+        size_t b = 0;
+        for (n /= PAGES_NUM - 1; n > 1; n >>= 1)
+            b++;
+        return std::min(b, LARGE_CACHE_BUCKETS - 1);
+    }
+    static uint32_t __now_ms();
+};
+
+// pageCache的一个分片: 自己的锁，自己的span链表，自己的span对象池
+// 小对象: 每个桶固定用一个分片(index % PAGE_SHARDS)
+// 大对象: 每个线程固定用一个分片(第一次用的时候轮流分配)
+// 空闲的span只和同一个分片的相邻span合并
+class page_heap {
+private:
+    span_list __span_lists[PAGES_NUM]; // 空闲的span，还有页在内存里
+    span_list __returned_lists[PAGES_NUM]; // 空闲的span，页全都还给操作系统了
+    size_t __free_pages = 0; // 空闲span里还在内存里的页
+    size_t __returned_pages = 0; // 空闲span里已经还给操作系统的页
+    size_t __in_use_pages = 0; // 分出去的页(给了cc或者直接给了大内存)
+    long long __scavenge_counter = RELEASE_DELAY_PAGES; // 还要释放多少页才做一次增量回收
+    size_t __release_index = PAGES_NUM - 1; // 增量回收轮到哪个桶了
     object_pool<span> __span_pool;
+    size_t __shard_id = 0; // 从1开始，span里面记的0表示不属于任何分片
+    id_span_map* __id_span_map = nullptr; // 所有分片共用一棵radix树(页号不会重叠)
+    bool __sampled = false;
+    std::mutex* __map_mtx = nullptr; // radix树长节点的时候要加的锁
+    large_span_cache* __large_cache = nullptr; // 所有分片共用，采样的分片不用
 
 public:
     std::mutex __page_mtx;
 
 public:
-    static page_cache* get_instance() { return &__s_inst; }
-    span* map_obj_to_span(void* obj);
+    // sampled: 这个分片的页从采样专用的地址空间里拿，用完了new_span返回nullptr
+    void init(size_t shard_id, id_span_map* map, std::mutex* map_mtx, large_span_cache* large_cache, bool sampled = false);
     // 释放空闲的span回到pc，并合并相邻的span
-    void release_span_to_page(span* s, size_t size = 0);
-
-public:
+    void release_span_to_page(span* s);
     // 获取一个K页的span
     span* new_span(size_t k);
+    // 获取一个K页的span，起始页号是align_pages的倍数(align_pages是2的幂)
+    span* new_aligned_span(size_t k, size_t align_pages);
+    // 把至少n页空闲页还给操作系统(不够就能还多少还多少)，返回实际还了多少页，调用前要加锁
+    // 先还整个都空闲的大页，break_hugepages为true的时候不够再拆大页还
+    size_t release_at_least_n_pages(size_t n, bool break_hugepages = true);
+    size_t free_pages() const { return __free_pages; }
+    size_t returned_pages() const { return __returned_pages; }
+    size_t in_use_pages() const { return __in_use_pages; }
+
+private:
+    // 第i号桶里面拿一个span出来(先拿页还在内存里的)，没有返回nullptr
+    span* __pop_free_span(size_t i);
+    // 空闲span挂上去/摘下来，两个计数按span上记的还掉的页数分开加减
+    void __push_free_span(span* s);
+    void __erase_free_span(span* s);
+    // 释放路径上的增量回收: 每释放一定数量的页，就还一些给操作系统
+    void __incremental_scavenge(size_t n);
+    // 大页相关: pc的内存都是按2MB对齐的大页要的，span不会跨大页
+    static PAGE_ID __hugepage_start(PAGE_ID id) { return id & ~(PAGE_ID)(HUGEPAGE_PAGES - 1); }
+    // 以start开头的大页是不是整个都空闲，并且还有页在内存里
+    bool __hugepage_free(PAGE_ID start);
+    // 还掉整个都空闲的大页，返回还了多少页
+    size_t __release_hugepages(size_t n);
+    span* __new_span_obj();
+    // 找系统要k页，采样分片的地址空间用完了返回nullptr
+    void* __system_alloc(size_t k, size_t align);
+    // 把页还给系统，采样分片的还给采样专用的地址空间，下次采样的时候再用
+    void __system_free(void* ptr, size_t k);
+    // 大于128页(或者要对齐)的span直接找系统要
+    span* __new_system_span(size_t k, size_t align);
+    // 把[id, id + n)这几页做成一个空闲span挂回去
+    void __release_piece(PAGE_ID id, size_t n);
+    bool __own(span* s) { return s->__shard == __shard_id; }
+};
+
+class page_cache {
+private:
+    page_heap __heaps[PAGE_SHARDS + 1]; // 最后一个是采样的分片
+    page_cache();
+    page_cache(const page_cache&) = delete;
+    // std::unordered_map<PAGE_ID, span*> __id_span_map;
+    id_span_map __id_span_map;
+    std::mutex __map_mtx;
+    large_span_cache __large_cache;
+    std::atomic<size_t> __release_rate;
+    std::atomic<bool> __scavenger_started;
+
+public:
+    static page_cache* get_instance() {
+        static page_cache __s_inst; // 和central_cache一样，第一次用的时候才构造
+        return &__s_inst;
+    }
+    span* map_obj_to_span(void* obj);
+    // 对象所在页的桶号+1，0表示不是cc切出来的页(大内存)
+    size_t obj_size_class(void* obj) const {
+        return __id_span_map.get_sizeclass((PAGE_ID)obj >> PAGE_SHIFT);
+    }
+    // cc切好一个span之后记一下每一页的桶号，释放小对象的时候就不用读span了
+    void set_span_size_class(span* s, size_t index) {
+        for (PAGE_ID i = 0; i < s->__n; i++)
+            __id_span_map.set_sizeclass(s->__page_id + i, (uint8_t)(index + 1));
+    }
+    // 小对象的第index个桶用哪个分片
+    page_heap* heap_for_class(size_t index) { return &__heaps[index % PAGE_SHARDS]; }
+    // 当前线程申请大对象用哪个分片
+    page_heap* heap_for_thread();
+    // span属于哪个分片，还回去的时候要还给它
+    page_heap* heap_of(span* s) {
+        assert(s->__shard >= 1 && s->__shard <= PAGE_SHARDS + 1);
+        return &__heaps[s->__shard - 1];
+    }
+    // 被采样的对象都从这个分片拿
+    page_heap* sampled_heap() { return &__heaps[SAMPLED_HEAP]; }
+    // ptr是不是被采样的对象，只比较一下地址
+    static bool is_sampled(const void* ptr) {
+#if defined(__linux__)
+        return system_region::sampled_instance()->contains(ptr);
+#else
+        return false;
+#endif
+    }
+
+public:
+    // 马上把至少bytes字节的空闲页还给操作系统(先把transfer cache拆回span，大span缓存里的先还)，返回实际还了多少字节
+    // break_hugepages为false的时候只还整个空闲的大页
+    size_t release_memory(size_t bytes, bool break_hugepages = true);
+    // 增量回收的速度: 每释放1000页空闲页，还rate页给操作系统，0表示不在释放路径上回收
+    void set_release_rate(size_t rate) { __release_rate = rate; }
+    size_t release_rate() const { return __release_rate; }
+    // 所有分片加起来的空闲页(包括大span缓存)，还给系统的页，分出去的页(不包括采样的分片)，采样的分片分出去的页
+    void get_stats(size_t& free_pages, size_t& returned_pages, size_t& in_use_pages, size_t& sampled_pages);
+    // 启动一个后台线程，每秒还bytes_per_second字节给操作系统(只还整个空闲的大页，不拆transfer cache)，只会启动一次
+    void start_scavenger(size_t bytes_per_second);
+
+private:
+    // 先还大span缓存里的，再还各个分片的空闲页
+    size_t __release_pages(size_t bytes, bool break_hugepages);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -23,8 +23,10 @@ public:
         // array_ = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
         size_t size = sizeof(void*) << BITS;
         size_t alignSize = size_class::__round_up(size, 1 << PAGE_SHIFT);
+        // 系统给的新页本来就是0，不要memset: memset会把整个数组的页都碰一遍，常驻内存一下子就上去了
+        // 不碰的话只有真正用到的页号所在的页才会占物理内存
         array_ = (void**)system_alloc(alignSize >> PAGE_SHIFT);
-        memset(array_, 0, sizeof(void*) << BITS);
+        system_stats::get_instance()->add_metadata(alignSize);
     }
 
     // Return the current value for KEY.  Returns NULL if not yet set,
@@ -62,7 +64,6 @@ private:
     };
 
     Leaf* root_[ROOT_LENGTH]; // Pointers to 32 child nodes
-    void* (*allocator_)(size_t); // Memory allocator
 
 public:
     typedef uintptr_t Number;
@@ -71,8 +72,7 @@ public:
     explicit TCMalloc_PageMap2() {
         // allocator_ = allocator;
         memset(root_, 0, sizeof(root_));
-
-        PreallocateMoreMemory();
+        // 叶子不再一开始全部建出来了，用到哪段页号再Ensure哪段
     }
 
     void* get(Number k) const {
@@ -134,6 +134,10 @@ private:
     static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;
     static const int LEAF_LENGTH = 1 << LEAF_BITS;
 
+public:
+    typedef uintptr_t Number;
+
+private:
     // Interior node
     struct Node {
         Node* ptrs[INTERIOR_LENGTH];
@@ -142,10 +146,21 @@ private:
     // Leaf node
     struct Leaf {
         void* values[LEAF_LENGTH];
+        uint8_t sizeclasses[LEAF_LENGTH]; // 每个页的size class(桶号+1)，0表示没有
     };
 
-    Node* root_; // Root of radix tree
-    void* (*allocator_)(size_t); // Memory allocator
+    Leaf* __leaf(Number k) const {
+        if ((k >> BITS) > 0)
+            return NULL;
+        Node* n = __atomic_load_n(&root_.ptrs[k >> (LEAF_BITS + INTERIOR_BITS)], __ATOMIC_ACQUIRE);
+        if (n == NULL)
+            return NULL;
+        return reinterpret_cast<Leaf*>(__atomic_load_n(&n->ptrs[(k >> LEAF_BITS) & (INTERIOR_LENGTH - 1)], __ATOMIC_ACQUIRE));
+    }
+
+    // 根节点直接放在对象里面(page_cache是静态对象，在bss段，不用的部分不占物理内存)
+    // 中间节点和叶子只在Ensure的时候按需从系统页里面要
+    Node root_; // Root of radix tree
 
     Node* NewNode() {
         // Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
@@ -158,22 +173,40 @@ private:
     }
 
 public:
-    typedef uintptr_t Number;
 
     // explicit TCMalloc_PageMap3(void* (*allocator)(size_t)) {
     explicit TCMalloc_PageMap3() {
         // allocator_ = allocator;
-        root_ = NewNode();
+        memset(&root_, 0, sizeof(root_));
     }
 
     void* get(Number k) const {
         const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
         const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
         const Number i3 = k & (LEAF_LENGTH - 1);
-        if ((k >> BITS) > 0 || root_->ptrs[i1] == NULL || root_->ptrs[i1]->ptrs[i2] == NULL) {
+        // 不加锁读，别的分片可能同时在写相邻的页，所以用原子读
+        if ((k >> BITS) > 0)
             return NULL;
-        }
-        return reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3];
+        Node* n = __atomic_load_n(&root_.ptrs[i1], __ATOMIC_ACQUIRE);
+        if (n == NULL)
+            return NULL;
+        Leaf* leaf = reinterpret_cast<Leaf*>(__atomic_load_n(&n->ptrs[i2], __ATOMIC_ACQUIRE));
+        if (leaf == NULL)
+            return NULL;
+        return __atomic_load_n(&leaf->values[i3], __ATOMIC_ACQUIRE);
+    }
+
+    // 小对象释放的时候只要知道桶号，读一个字节就行，不用再去读span
+    uint8_t get_sizeclass(Number k) const {
+        Leaf* leaf = __leaf(k);
+        if (leaf == NULL)
+            return 0;
+        return __atomic_load_n(&leaf->sizeclasses[k & (LEAF_LENGTH - 1)], __ATOMIC_RELAXED);
+    }
+
+    void set_sizeclass(Number k, uint8_t v) {
+        ASSERT(k >> BITS == 0);
+        __atomic_store_n(&__leaf(k)->sizeclasses[k & (LEAF_LENGTH - 1)], v, __ATOMIC_RELAXED);
     }
 
     void set(Number k, void* v) {
@@ -181,7 +214,7 @@ public:
         const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
         const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
         const Number i3 = k & (LEAF_LENGTH - 1);
-        reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3] = v;
+        __atomic_store_n(&reinterpret_cast<Leaf*>(root_.ptrs[i1]->ptrs[i2])->values[i3], v, __ATOMIC_RELEASE);
     }
 
     bool Ensure(Number start, size_t n) {
@@ -194,20 +227,22 @@ public:
                 return false;
 
             // Make 2nd level node if necessary
-            if (root_->ptrs[i1] == NULL) {
+            if (root_.ptrs[i1] == NULL) {
                 Node* n = NewNode();
                 if (n == NULL)
                     return false;
-                root_->ptrs[i1] = n;
+                __atomic_store_n(&root_.ptrs[i1], n, __ATOMIC_RELEASE); // 节点清零之后再发布出去
             }
 
             // Make leaf node if necessary
-            if (root_->ptrs[i1]->ptrs[i2] == NULL) {
-                Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+            if (root_.ptrs[i1]->ptrs[i2] == NULL) {
+                // Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
+                static object_pool<Leaf> leaf_pool;
+                Leaf* leaf = (Leaf*)leaf_pool.new_();
                 if (leaf == NULL)
                     return false;
                 memset(leaf, 0, sizeof(*leaf));
-                root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
+                __atomic_store_n(&root_.ptrs[i1]->ptrs[i2], reinterpret_cast<Node*>(leaf), __ATOMIC_RELEASE);
             }
 
             // Advance key past whatever is covered by this leaf node
@@ -0,0 +1,63 @@
+
+#ifndef __YUFC_SAMPLER_HPP__
+#define __YUFC_SAMPLER_HPP__
+
+#include "./common.hpp"
+#include "./object_pool.hpp"
+#include <atomic>
+
+// 采样的堆分析器
+// 平均每分配sample_period字节采样一次(间隔是指数分布的随机数，不会总是采到同一个调用点)
+// 采到的对象单独从pc的采样分片里拿一个span，记下调用栈，释放的时候从表里删掉
+// 没采到的分配只多了一次线程局部计数器的减法
+// 默认关闭，环境变量 TCMALLOC_SAMPLE_PARAMETER=字节数 或者 tcmalloc_set_sample_period() 打开
+
+static const int MAX_STACK_DEPTH = 32;
+static const size_t SAMPLE_BUCKETS = 4096; // 存活样本的哈希表大小
+static const long long SAMPLE_RECHECK_BYTES = 1 << 20; // 采样关着的时候，每分配这么多字节再看一次开没开
+
+class heap_sampler {
+private:
+    struct sample_record {
+        void* ptr;
+        size_t size; // 申请的大小
+        int depth;
+        void* stack[MAX_STACK_DEPTH];
+        sample_record* next;
+    };
+    sample_record* __buckets[SAMPLE_BUCKETS];
+    object_pool<sample_record> __record_pool;
+    std::mutex __mtx;
+    std::atomic<size_t> __period;
+
+private:
+    heap_sampler();
+    heap_sampler(const heap_sampler&) = delete;
+
+public:
+    static heap_sampler* get_instance() {
+        static heap_sampler __s_inst;
+        return &__s_inst;
+    }
+    // tcmalloc的计数器减到负数的时候调用: 重新设置计数器，需要采样的话分配并记录，返回nullptr表示这次不采样
+    void* sample(size_t size, long long& bytes_until_sample);
+    // 被采样的对象释放的时候调用
+    void remove(void* ptr);
+    void set_period(size_t bytes) { __period = bytes; }
+    size_t period() const { return __period; }
+    // 把存活的样本按pprof的旧版堆文件格式(heap_v2)写到fd，成功返回true
+    bool dump(int fd);
+
+private:
+    static size_t __hash(void* ptr) { return ((uintptr_t)ptr >> PAGE_SHIFT) & (SAMPLE_BUCKETS - 1); }
+    static long long __next_interval(size_t period);
+    void* __allocate(size_t size);
+    void __record(void* ptr, size_t size);
+};
+
+// 设置采样间隔(字节)，0表示关闭
+void tcmalloc_set_sample_period(size_t bytes);
+// 把存活的样本写到path，可以用 pprof <程序> <path> 查看
+bool tcmalloc_dump_heap_profile(const char* path);
+
+#endif
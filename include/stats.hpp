@@ -0,0 +1,41 @@
+
+#ifndef __YUFC_STATS_HPP__
+#define __YUFC_STATS_HPP__
+
+#include "./common.hpp"
+
+// 每个size class的统计
+struct tc_class_stats {
+    size_t obj_size = 0; // 对象大小
+    size_t span_bytes = 0; // cc手里这个桶的span一共多少字节
+    size_t in_use_objs = 0; // 程序正在用的对象
+    size_t central_objs = 0; // 挂在span自由链表上的
+    size_t transfer_objs = 0; // transfer cache里的
+    size_t thread_objs = 0; // 所有threadCache里的(包括远程队列里还没被拿走的)
+    size_t cpu_objs = 0; // 所有cpuCache里的
+    size_t fragmentation_bytes = 0; // span_bytes里面没有被程序用着的(各级缓存 + span尾巴上切不出对象的)
+};
+
+// 整个分配器的统计，各个字段之间不是同一时刻的快照，只是近似值
+struct tc_stats {
+    size_t system_bytes = 0; // 从系统要的内存(包括已经还回去的页)
+    size_t metadata_bytes = 0; // 元数据: span对象，radix树，threadCache对象，cpuCache的槽
+    size_t metadata_unused_bytes = 0; // 其中metadata_arena要来了还没切出去的
+    size_t in_use_bytes = 0; // 程序正在用的(小对象 + 大内存)
+    size_t large_in_use_bytes = 0; // 其中大于256KB直接从pc拿的(不包括被采样的)
+    size_t sampled_in_use_bytes = 0; // 其中被采样的对象，不管大小每个样本都单独占整页，不算在size class里
+    size_t thread_cache_bytes = 0;
+    size_t cpu_cache_bytes = 0;
+    size_t transfer_cache_bytes = 0;
+    size_t central_cache_bytes = 0; // span自由链表上的对象
+    size_t page_heap_free_bytes = 0; // pc里面还在内存里的空闲页
+    size_t page_heap_returned_bytes = 0; // pc里面已经还给系统的空闲页
+    tc_class_stats classes[BUCKETS_NUM];
+};
+
+// 收集统计，计数器大部分不用加锁读，只有transfer cache和pc的几个计数要短暂地拿一下锁
+void tcmalloc_get_stats(tc_stats* stats);
+// 把统计写成人能看的文本，写进buf(最多len字节，包括结尾的0)，返回需要的长度(不包括结尾的0)，和snprintf一样
+size_t tcmalloc_print_stats(char* buf, size_t len);
+
+#endif
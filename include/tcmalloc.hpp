@@ -1,49 +1,203 @@
-
 #ifndef __YUFC_TCMALLOC_HPP__
 #define __YUFC_TCMALLOC_HPP__
 
 #include "common.hpp"
+#include "cpu_cache.hpp"
+#include <pthread.h>
 #include "log.hpp"
 #include "object_pool.hpp"
 #include "page_cache.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
 #include "thread_cache.hpp"
 
-static void* tcmalloc(size_t size) {
+static std::mutex tc_mtx;
+static object_pool<thread_cache> tc_pool;
+static pthread_key_t tc_key;
+static pthread_once_t tc_key_once = PTHREAD_ONCE_INIT;
+static __thread long long tc_bytes_until_sample = 0; // 减到负数的时候去问一下要不要采样
+
+// 线程退出的时候调用: 把threadCache里面挂着的内存还给centralCache，threadCache本身还给tc_pool
+// 否则线程池不停地创建销毁线程，死掉的线程占着的内存就永远拿不回来了
+static void thread_cache_exit(void* ptr) {
+    thread_cache* tc = (thread_cache*)ptr;
+    tc->release_all();
+    p_tls_thread_cache = nullptr; // 后面其他key的析构还可能再malloc，到时候会重新创建并再次登记
+    std::lock_guard<std::mutex> lock(tc_mtx);
+    tc_pool.delete_(tc);
+}
+
+static void thread_cache_key_create() {
+    pthread_key_create(&tc_key, thread_cache_exit);
+}
+
+// 拿到当前线程的threadCache，第一次用的时候创建
+// tcfree也要用: 一个线程可能从来没申请过，只释放别的线程给它的内存
+static thread_cache* get_thread_cache() {
+    if (p_tls_thread_cache == nullptr) {
+        // 相当于单例
+        // p_tls_thread_cache = new thread_cache;
+        pthread_once(&tc_key_once, thread_cache_key_create);
+        {
+            std::lock_guard<std::mutex> lock(tc_mtx); // 多个线程同时第一次申请，会一起去切tc_pool
+            p_tls_thread_cache = tc_pool.new_();
+        }
+        pthread_setspecific(tc_key, p_tls_thread_cache); // 登记一下，线程退出的时候回调thread_cache_exit
+    }
+    return p_tls_thread_cache;
+}
+
+static inline void* tcmalloc(size_t size) {
+    if (size == 0)
+        size = 1; // malloc(0)也要返回一个能free的指针
+    if ((tc_bytes_until_sample -= (long long)size) < 0) {
+        void* ptr = heap_sampler::get_instance()->sample(size, tc_bytes_until_sample);
+        if (ptr != nullptr)
+            return ptr;
+    }
     if (size > MAX_BYTES) {
         // 处理申请大内存的情况
         size_t align_size = size_class::round_up(size);
         size_t k_page = align_size >> PAGE_SHIFT;
-        page_cache::get_instance()->__page_mtx.lock();
-        span* cur_span = page_cache::get_instance()->new_span(k_page); // 直接找pc
+        page_heap* heap = page_cache::get_instance()->heap_for_thread(); // 直接找pc，每个线程固定用一个分片
+        heap->__page_mtx.lock();
+        span* cur_span = heap->new_span(k_page);
         cur_span->__obj_size = size;
-        page_cache::get_instance()->__page_mtx.unlock();
+        cur_span->__is_use = true; // 防止相邻span还回来的时候把它合并掉
+        heap->__page_mtx.unlock();
         void* ptr = (void*)(cur_span->__page_id << PAGE_SHIFT); // span转化成地址
         return ptr;
     }
-    if (p_tls_thread_cache == nullptr) {
-        // 相当于单例
-        // p_tls_thread_cache = new thread_cache;
-        static object_pool<thread_cache> tc_pool;
-        p_tls_thread_cache = tc_pool.new_();
-    }
 #ifdef PROJECT_DEBUG
     LOG(DEBUG) << "tcmalloc find tc from mem" << std::endl;
 #endif
-    return p_tls_thread_cache->allocate(size);
+    if (cpu_cache::get_instance()->active())
+        return cpu_cache::get_instance()->allocate(size); // 打开了每CPU缓存
+    return get_thread_cache()->allocate(size);
 }
 
-static void tcfree(void* ptr) {
-    span* s = page_cache::get_instance()->map_obj_to_span(ptr); // 找到这个span就能找到obj_size了
-    size_t size = s->__obj_size; // 找到大小了
-    if (size > MAX_BYTES) {
-        span* s = page_cache::get_instance()->map_obj_to_span(ptr); // 找到这个span
-        page_cache::get_instance()->__page_mtx.lock();
-        page_cache::get_instance()->release_span_to_page(s, size); // 直接调用pc的
-        page_cache::get_instance()->__page_mtx.unlock();
+static inline void tcfree(void* ptr) {
+    size_t size = 0;
+    size_t cls = page_cache::get_instance()->obj_size_class(ptr);
+    if (cls != 0) {
+        // 小对象: radix树的叶子上直接记了桶号，不用读span
+        size = size_class::bucket_size(cls - 1);
+    } else {
+        span* s = page_cache::get_instance()->map_obj_to_span(ptr); // 找到这个span就能找到obj_size了
+        size = s->__obj_size; // 找到大小了
+        if (size > MAX_BYTES) {
+            if (page_cache::is_sampled(ptr))
+                heap_sampler::get_instance()->remove(ptr); // 被采样的对象，从样本表里删掉
+            page_heap* heap = page_cache::get_instance()->heap_of(s); // 还给它原来的分片
+            heap->__page_mtx.lock();
+            heap->release_span_to_page(s); // 直接调用pc的
+            heap->__page_mtx.unlock();
+            return;
+        }
+    }
+    if (cpu_cache::get_instance()->active()) {
+        cpu_cache::get_instance()->deallocate(ptr, size);
         return;
     }
-    assert(p_tls_thread_cache);
-    p_tls_thread_cache->deallocate(ptr, size);
+    get_thread_cache()->deallocate(ptr, size);
 }
 
-#endif
\ No newline at end of file
+// 调用者知道对象大小的时候用这个释放(C++14的sized delete)
+// 小对象直接按size算桶还给threadCache/cpuCache，不用查radix树和span，释放路径上少几次cache miss
+// size必须和申请的时候一样(或者落在同一个size class里面)，tcmalloc_aligned拿到的内存不能用这个还
+static inline void tcfree_sized(void* ptr, size_t size) {
+    if (size == 0)
+        size = 1;
+    if (size > MAX_BYTES || page_cache::is_sampled(ptr)) {
+        // 大内存和被采样的对象要拿到span才能还给pc，还是得查
+        tcfree(ptr);
+        return;
+    }
+#ifdef PROJECT_DEBUG
+    span* s = page_cache::get_instance()->map_obj_to_span(ptr);
+    if (s->__obj_size != size_class::round_up(size)) {
+        LOG(FATAL) << "tcfree_sized: size " << size << " does not match the object size " << s->__obj_size << std::endl;
+        assert(false);
+    }
+#endif
+    if (cpu_cache::get_instance()->active()) {
+        cpu_cache::get_instance()->deallocate(ptr, size);
+        return;
+    }
+    get_thread_cache()->deallocate(ptr, size);
+}
+
+// 一次申请n个size字节的对象放进out，用tcfree/tcfree_sized/tcfree_batch释放都可以
+// 小对象直接和threadCache的自由链表整段交换，每个对象不用再走一遍tcmalloc
+static inline void tcmalloc_batch(size_t size, size_t n, void** out) {
+    if (size == 0)
+        size = 1;
+    long long bytes = (long long)(size * n);
+    if (size > MAX_BYTES || cpu_cache::get_instance()->active() || tc_bytes_until_sample < bytes) {
+        // 大内存、每CPU缓存、或者这一批里面有要采样的: 一个一个来
+        for (size_t i = 0; i < n; i++)
+            out[i] = tcmalloc(size);
+        return;
+    }
+    tc_bytes_until_sample -= bytes;
+    get_thread_cache()->allocate_batch(size, n, out);
+}
+
+// 一次释放n个size字节的对象，和tcfree_sized一样，size要和申请的时候一样
+static inline void tcfree_batch(void** ptrs, size_t n, size_t size) {
+    if (size == 0)
+        size = 1;
+    bool slow = size > MAX_BYTES || cpu_cache::get_instance()->active();
+    for (size_t i = 0; i < n && !slow; i++)
+        slow = page_cache::is_sampled(ptrs[i]); // 被采样的对象要从pc还
+    if (slow) {
+        for (size_t i = 0; i < n; i++)
+            tcfree_sized(ptrs[i], size);
+        return;
+    }
+#ifdef PROJECT_DEBUG
+    for (size_t i = 0; i < n; i++) {
+        span* s = page_cache::get_instance()->map_obj_to_span(ptrs[i]);
+        if (s->__obj_size != size_class::round_up(size)) {
+            LOG(FATAL) << "tcfree_batch: size " << size << " does not match the object size " << s->__obj_size << std::endl;
+            assert(false);
+        }
+    }
+#endif
+    get_thread_cache()->deallocate_batch(ptrs, n, size);
+}
+
+// ptr实际能用的字节数，小对象就是所在桶的大小，大对象就是整个span
+static inline size_t tcmalloc_usable_size(void* ptr) {
+    size_t cls = page_cache::get_instance()->obj_size_class(ptr);
+    if (cls != 0)
+        return size_class::bucket_size(cls - 1);
+    span* s = page_cache::get_instance()->map_obj_to_span(ptr);
+    if (s->__obj_size > MAX_BYTES)
+        return s->__n << PAGE_SHIFT;
+    return s->__obj_size;
+}
+
+// 按align对齐申请，释放用tcfree(不能用tcfree_sized)
+// span的起始地址是按页对齐的，只要size class是align的整数倍，切出来的每个对象就都是对齐的
+// 超过一页的对齐只能直接要页对齐的span了
+static inline void* tcmalloc_aligned(size_t size, size_t align) {
+    assert(align != 0 && (align & (align - 1)) == 0);
+    if (size == 0)
+        size = 1;
+    if (align <= ((size_t)1 << PAGE_SHIFT)) {
+        // 不超过一页的对齐: 挑一个对象本身就对齐的size class，和普通的申请一样快
+        return tcmalloc(size_class::aligned_round_up(size, align));
+    }
+    // 超过一页的对齐: 直接从pc要一个起始页号对齐的span
+    size_t k_page = size_class::__round_up(size, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+    page_heap* heap = page_cache::get_instance()->heap_for_thread();
+    heap->__page_mtx.lock();
+    span* cur_span = heap->new_aligned_span(k_page, align >> PAGE_SHIFT);
+    cur_span->__obj_size = std::max(size, MAX_BYTES + 1); // 小于256KB也要按大内存还回pc，不能进threadCache
+    cur_span->__is_use = true;
+    heap->__page_mtx.unlock();
+    return (void*)(cur_span->__page_id << PAGE_SHIFT);
+}
+
+#endif
@@ -1,25 +1,108 @@
 
-
 #ifndef __YUFC_THREAD_CACHE_HPP__
 #define __YUFC_THREAD_CACHE_HPP__
 
 #include "./common.hpp"
+#include <atomic>
+
+// 所有线程的threadCache加起来最多缓存这么多字节
+static const size_t OVERALL_THREAD_CACHE_SIZE = 32 * 1024 * 1024; // 32MB
+// 每个threadCache至少能缓存这么多字节
+static const size_t MIN_THREAD_CACHE_SIZE = MAX_BYTES * 2; // 512KB
+// threadCache额度不够的时候，一次从全局(或者别的线程)拿这么多
+static const size_t STEAL_AMOUNT = 64 * 1024; // 64KB
+// 自由链表的上限最多涨到多少个对象(总字节数还受threadCache的额度限制)
+static const size_t MAX_DYNAMIC_FREE_LIST_LENGTH = 8192;
+// 链表连续这么多次涨到上限，就把上限降一批
+static const size_t MAX_OVERAGES = 3;
+// 每释放这么多个对象，检查一次哪些链表闲着，闲着的还一半回去
+static const size_t IDLE_CHECK_FREES = 64 * 1024;
+// 最多给多少个threadCache分远程队列，再多的线程就不走跨线程释放了
+static const size_t MAX_REMOTE_OWNERS = 256;
+// 每个远程队列的每个桶最多挂多少字节(至少能放一整批)，主人一直不来拿的话，再多的就还给centralCache
+static const size_t REMOTE_QUEUE_BYTES = 512 * 1024;
+
+// 跨线程释放: 别的线程还给某个threadCache的对象，每个桶一个无锁栈
+// 释放的线程只往上压一整批(CAS)，主人一次把整个栈拿走(exchange)，没有ABA问题
+// 放在全局的数组里，不放在threadCache里: 主人退出之后别的线程可能还会往里压，不能跟着threadCache一起回收
+struct remote_queue {
+    std::atomic<void*> heads[BUCKETS_NUM];
+    std::atomic<size_t> objs[BUCKETS_NUM]; // 每个桶挂了多少个对象，限制长度和统计用
+};
 
 class thread_cache {
 private:
     free_list __free_lists[BUCKETS_NUM]; // 哈希表
+    size_t __size = 0; // 当前缓存了多少字节
+    std::atomic<size_t> __max_size; // 当前线程的额度，别的线程偷额度的时候会改这个值
+    // 所有活着的threadCache串成一个链表，偷额度的时候要遍历
+    thread_cache* __next = nullptr;
+    thread_cache* __prev = nullptr;
+    size_t __owner_id = 0; // 远程队列的编号(从1开始)，0表示没分到
+    size_t __frees_until_idle_check = IDLE_CHECK_FREES;
+
+private:
+    // 全局的额度管理，都由__s_budget_mtx保护
+    static std::mutex __s_budget_mtx;
+    static thread_cache* __s_head; // 活着的threadCache链表
+    static thread_cache* __s_next_steal; // 下一次从谁那里偷
+    static long long __s_unclaimed; // 还没有分给任何线程的额度，可能是负数
+    static size_t __s_overall_size; // 总额度
+    // 哪些远程队列编号有主人了，改的时候拿着__s_budget_mtx，跨线程释放的时候不拿锁读，主人退出了就不往里压了
+    static std::atomic<bool> __s_owner_used[MAX_REMOTE_OWNERS + 1];
+    static remote_queue __s_remote[MAX_REMOTE_OWNERS + 1];
 
 public:
+    thread_cache();
+    ~thread_cache();
     void* allocate(size_t size);
     void deallocate(void* ptr, size_t size);
+    // 一次申请/释放n个同样大小的对象，和自由链表整段交换
+    // n比这个桶的链表上限还大的时候，直接和centralCache按批交换，不经过自由链表
+    void allocate_batch(size_t size, size_t n, void** out);
+    void deallocate_batch(void** ptrs, size_t n, size_t size);
 
 public:
     // 向centralCache获取内存
     void* fetch_from_central_cache(size_t index, size_t size);
-    // 释放对象，链表过长的时候，回收内存到centralCache
+    // 释放对象，链表过长的时候，回收内存到centralCache(size是桶的对齐大小)
     void list_too_long(free_list& list, size_t size);
+    // 线程退出的时候，把所有桶里的对象都还给centralCache，不再当远程队列的主人，队列里的也还掉
+    void release_all();
+    // 缓存的字节数超过了额度: 先还闲着的对象，还不够每个桶再还一半给centralCache，然后再去要一点额度
+    void scavenge();
+    // 修改所有threadCache加起来的总额度
+    static void set_overall_cache_size(size_t bytes);
+    // 当前缓存了多少字节，额度是多少
+    size_t size() const { return __size; }
+    size_t max_size() const { return __max_size; }
+    // 所有threadCache(和远程队列)每个桶里缓存了多少个对象(加到objs上)，返回一共缓存的字节数
+    // 别的线程同时在分配释放，读到的只是一个近似值
+    static size_t get_stats(size_t* objs);
+
+private:
+    // 调用前要拿着__s_budget_mtx
+    void __increase_cache_limit_locked();
+    // 这一批对象的span记着别的threadCache，就整批压到它的远程队列里，成功返回true
+    bool __push_remote(void* start, void* end, size_t n, size_t size);
+    // 把自己第index个桶的远程队列整个拿出来，返回个数
+    size_t __pop_remote(size_t index, void*& start, void*& end);
+    // 把owner的第index个桶的远程队列整个拿出来，返回个数
+    static size_t __take_remote(size_t owner, size_t index, void*& start, void*& end);
+    // 每个链表从上次检查到现在一直没用到的对象(low water)还一半给cc，上限降一批
+    void __release_idle_objects();
+    // 记一下释放了n个对象，够数了就检查一次闲着的链表
+    void __count_frees(size_t n) {
+        if (__frees_until_idle_check > n) {
+            __frees_until_idle_check -= n;
+            return;
+        }
+        __frees_until_idle_check = IDLE_CHECK_FREES;
+        __release_idle_objects();
+    }
 };
 
-static __thread thread_cache* p_tls_thread_cache = nullptr;
+// 每个线程自己的threadCache，定义在thread_cache.cc里，只有一份
+extern __thread thread_cache* p_tls_thread_cache;
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,252 @@
+
+// 把libc的内存分配接口全部换成tcmalloc
+// 编译成libtcmalloc.so之后，不用重新编译就能用在任何程序上:
+//      LD_PRELOAD=./libtcmalloc.so ./a.out
+// 注意这个文件不能开PROJECT_DEBUG，LOG会走iostream，iostream又会调用malloc
+
+#include "./include/tcmalloc.hpp"
+#include <errno.h>
+#include <new>
+#include <string.h>
+#include <unistd.h>
+
+// glibc的malloc至少保证16字节对齐(max_align_t)，很多程序(SSE等)依赖这一点
+static const size_t MIN_ALIGN = 16;
+
+// malloc实际向tc要的大小，sized delete还回去的时候也要用同样的大小
+static inline size_t __malloc_size(size_t size) {
+    if (size > MIN_ALIGN / 2)
+        size = size_class::__round_up(size, MIN_ALIGN);
+    return size;
+}
+
+static inline void* __do_malloc(size_t size) {
+    size = __malloc_size(size);
+    try {
+        return tcmalloc(size);
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+static inline void* __do_memalign(size_t align, size_t size) {
+    if (align <= MIN_ALIGN)
+        return __do_malloc(size);
+    void* ptr = nullptr;
+    try {
+        ptr = tcmalloc_aligned(size, align);
+    } catch (const std::bad_alloc&) {
+        ptr = nullptr;
+    }
+    if (ptr == nullptr)
+        errno = ENOMEM;
+    return ptr;
+}
+
+static inline bool __is_power_of_two(size_t n) {
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+extern "C" {
+
+void* malloc(size_t size) {
+    return __do_malloc(size);
+}
+
+void free(void* ptr) {
+    if (ptr == nullptr)
+        return;
+    tcfree(ptr);
+}
+
+void* calloc(size_t n, size_t size) {
+    size_t bytes = n * size;
+    if (size != 0 && bytes / size != n) {
+        // 乘法溢出
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void* ptr = __do_malloc(bytes);
+    if (ptr != nullptr)
+        memset(ptr, 0, bytes); // 从tc拿到的内存可能是别人用过的
+    return ptr;
+}
+
+void* realloc(void* old_ptr, size_t size) {
+    if (old_ptr == nullptr)
+        return __do_malloc(size);
+    if (size == 0) {
+        tcfree(old_ptr);
+        return nullptr;
+    }
+    size_t old_size = tcmalloc_usable_size(old_ptr);
+    // 原来的块够用，并且不会浪费一半以上，就原地返回
+    if (size <= old_size && size >= old_size / 2)
+        return old_ptr;
+    void* new_ptr = __do_malloc(size);
+    if (new_ptr == nullptr)
+        return nullptr;
+    memcpy(new_ptr, old_ptr, std::min(old_size, size));
+    tcfree(old_ptr);
+    return new_ptr;
+}
+
+void* reallocarray(void* old_ptr, size_t n, size_t size) {
+    // glibc的reallocarray直接调内部的realloc，不替换的话会拿着我们的指针去glibc里面释放
+    size_t bytes = n * size;
+    if (size != 0 && bytes / size != n) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(old_ptr, bytes);
+}
+
+void* memalign(size_t align, size_t size) {
+    if (!__is_power_of_two(align)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return __do_memalign(align, size);
+}
+
+int posix_memalign(void** res, size_t align, size_t size) {
+    if (!__is_power_of_two(align) || align % sizeof(void*) != 0)
+        return EINVAL;
+    void* ptr = __do_memalign(align, size);
+    if (ptr == nullptr)
+        return ENOMEM;
+    *res = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+    return memalign(align, size);
+}
+
+void* valloc(size_t size) {
+    return __do_memalign(getpagesize(), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page_size = getpagesize();
+    return __do_memalign(page_size, size_class::__round_up(size == 0 ? 1 : size, page_size));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == nullptr)
+        return 0;
+    return tcmalloc_usable_size(ptr);
+}
+
+void malloc_stats(void) {
+    // 和glibc一样打到stderr上
+    char buf[32 * 1024];
+    size_t n = std::min(tcmalloc_print_stats(buf, sizeof(buf)), sizeof(buf) - 1);
+    ssize_t ret = write(STDERR_FILENO, buf, n);
+    (void)ret;
+}
+
+} // extern "C"
+
+// C++的new/delete也接过来
+void* operator new(size_t size) {
+    void* ptr = __do_malloc(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    void* ptr = __do_malloc(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return __do_malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return __do_malloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+// C++14的sized delete: 编译器知道对象大小，释放的时候不用查span
+void operator delete(void* ptr, size_t size) noexcept {
+    if (ptr == nullptr)
+        return;
+    tcfree_sized(ptr, __malloc_size(size));
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+    if (ptr == nullptr)
+        return;
+    tcfree_sized(ptr, __malloc_size(size));
+}
+
+#ifdef __cpp_aligned_new
+// C++17的对齐new/delete(alignas超过16字节的类型)
+// 对齐申请的内存不一定落在size对应的size class里面，所以delete的时候不用sized的路径
+void* operator new(size_t size, std::align_val_t align) {
+    void* ptr = __do_memalign((size_t)align, size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    void* ptr = __do_memalign((size_t)align, size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return __do_memalign((size_t)align, size);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return __do_memalign((size_t)align, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+#endif
@@ -2,11 +2,63 @@
 #include "../include/central_cache.hpp"
 #include "../include/log.hpp"
 #include "../include/page_cache.hpp"
+#include <string.h>
 
-central_cache central_cache::__s_inst;
+bool transfer_cache::insert_range(void* start, void* end, size_t n, size_t max_objs) {
+    std::lock_guard<std::mutex> lock(__mtx);
+    if (__used == TRANSFER_SLOTS || __objs + n > max_objs)
+        return false;
+    __slots[__used].start = start;
+    __slots[__used].end = end;
+    __slots[__used].n = n;
+    ++__used;
+    __objs += n;
+    return true;
+}
+
+size_t transfer_cache::remove_range(void*& start, void*& end, size_t batch_num) {
+    std::lock_guard<std::mutex> lock(__mtx);
+    if (__used == 0)
+        return 0;
+    batch& top = __slots[__used - 1];
+    if (top.n <= batch_num) {
+        // 整批拿走
+        start = top.start;
+        end = top.end;
+        size_t n = top.n;
+        --__used;
+        __objs -= n;
+        return n;
+    }
+    // 这一批比要的多，从头上切batch_num个下来，剩下的留着
+    start = top.start;
+    end = start;
+    for (size_t i = 0; i < batch_num - 1; i++)
+        end = free_list::__next_obj(end);
+    top.start = free_list::__next_obj(end);
+    free_list::__next_obj(end) = nullptr;
+    top.n -= batch_num;
+    __objs -= batch_num;
+    return batch_num;
+}
 
-size_t central_cache::fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size) {
+size_t transfer_cache::pop_batch(void*& start, void*& end) {
+    std::lock_guard<std::mutex> lock(__mtx);
+    if (__used == 0)
+        return 0;
+    --__used;
+    start = __slots[__used].start;
+    end = __slots[__used].end;
+    __objs -= __slots[__used].n;
+    return __slots[__used].n;
+}
+
+size_t central_cache::fetch_range_obj(void*& start, void*& end, size_t batch_num, size_t size, size_t owner) {
     size_t index = size_class::bucket_index(size); // 算出在哪个桶找
+    // 先看transfer cache里面有没有别的线程还回来的整批对象
+    size_t n = __transfer_caches[index].remove_range(start, end, batch_num);
+    if (n > 0)
+        return n;
     __span_lists[index].__bucket_mtx.lock(); // 加锁（可以考虑RAII）
 #ifdef PROJECT_DEBUG
     LOG(DEBUG) << "central_cache::fetch_range_obj() call central_cache::get_non_empty_span()" << std::endl;
@@ -29,18 +81,21 @@ size_t central_cache::fetch_range_obj(void*& start, void*& end, size_t batch_num
     cur_span->__free_list = free_list::__next_obj(end);
     free_list::__next_obj(end) = nullptr;
     cur_span->__use_count += actual_n; // 拿走了几个，use_count记得加上去
+    __atomic_store_n(&cur_span->__owner, (uint16_t)owner, __ATOMIC_RELAXED); // 别的线程释放的时候不拿锁读
+    __stats[index].out_objs.fetch_add(actual_n, std::memory_order_relaxed);
+    if (cur_span->__free_list == nullptr) {
+        // 这个span切完了，挪到满链表里，下次找非空span就不用再扫到它
+        __span_lists[index].erase(cur_span);
+        __full_lists[index].push_front(cur_span);
+    }
     __span_lists[index].__bucket_mtx.unlock(); // 解锁
     return actual_n;
 }
 
 span* central_cache::get_non_empty_span(span_list& list, size_t size) {
-    // 先查看当前的spanlist中是否还有非空的span
-    span* it = list.begin();
-    while (it != list.end()) {
-        if (it->__free_list != nullptr) // 找到非空的了
-            return it;
-        it = it->__next;
-    }
+    // 满了的span都在__full_lists里，这个链表上挂的span一定是非空的，直接拿第一个
+    if (!list.empty())
+        return list.begin();
 #ifdef PROJECT_DEBUG
     LOG(DEBUG) << "central_cache::get_non_empty_span() cannot find non-null span in cc, goto pc for mem" << std::endl;
 #endif
@@ -51,14 +106,16 @@ span* central_cache::get_non_empty_span(span_list& list, size_t size) {
 #ifdef PROJECT_DEBUG
     LOG(DEBUG) << "central_cache::get_non_empty_span() call page_cache::get_instance()->new_span()" << std::endl;
 #endif
-    page_cache::get_instance()->__page_mtx.lock();
-    span* cur_span = page_cache::get_instance()->new_span(size_class::num_move_page(size));
+    page_heap* heap = page_cache::get_instance()->heap_for_class(size_class::bucket_index(size)); // 每个桶固定用一个分片
+    heap->__page_mtx.lock();
+    span* cur_span = heap->new_span(size_class::num_move_page(size));
     cur_span->__is_use = true; // 表示已经被使用
     cur_span->__obj_size = size; 
-    page_cache::get_instance()->__page_mtx.unlock();
+    heap->__page_mtx.unlock();
 #ifdef PROJECT_DEBUG
     LOG(DEBUG) << "central_cache::get_non_empty_span() get new span success" << std::endl;
 #endif
+    page_cache::get_instance()->set_span_size_class(cur_span, size_class::bucket_index(size));
     // 切分的逻辑
     // 1. 计算span的大块内存的起始地址和大块内存的大小（字节数）
     char* addr_start = (char*)(cur_span->__page_id << PAGE_SHIFT);
@@ -72,7 +129,7 @@ span* central_cache::get_non_empty_span(span_list& list, size_t size) {
     LOG(DEBUG) << "central_cache::get_non_empty_span() cut span" << std::endl;
 #endif
     int i = 1;
-    while (addr_start < addr_end) {
+    while (addr_start + size <= addr_end) { // 最后一块放不下完整的对象就不要了，否则会越界写到下一个span
         ++i;
         free_list::__next_obj(tail) = addr_start; // tail不是空指针
         // std::cerr << "here" << std::endl;
@@ -83,47 +140,111 @@ span* central_cache::get_non_empty_span(span_list& list, size_t size) {
     // 恢复锁
     list.__bucket_mtx.lock();
     list.push_front(cur_span);
+    size_t index = size_class::bucket_index(size);
+    __stats[index].span_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    __stats[index].capacity_objs.fetch_add(i, std::memory_order_relaxed);
     return cur_span;
 }
 
 void central_cache::release_list_to_spans(void* start, size_t size) {
     size_t index = size_class::bucket_index(size); // 先算一下在哪一个桶里面
-    __span_lists[index].__bucket_mtx.lock();
     // 这里要注意，一个桶挂了多个span，这些内存块挂到哪一个span是不确定的
+    // 所以先在锁外面查radix树，按span分好组(这些对象还在我们手里，它们的span不会变)
+    span_group groups[RELEASE_GROUPS];
+    memset(groups, 0, sizeof(groups));
+    size_t used = 0;
     while (start) {
         // 遍历这个链表
         void* next = free_list::__next_obj(start); // 先记录一下下一个，避免等下找不到了
         span* cur_span = page_cache::get_instance()->map_obj_to_span(start);
-        free_list::__next_obj(start) = cur_span->__free_list;
-        cur_span->__free_list = start;
+        size_t h = ((uintptr_t)cur_span / sizeof(span)) & (RELEASE_GROUPS - 1);
+        while (groups[h].s != nullptr && groups[h].s != cur_span)
+            h = (h + 1) & (RELEASE_GROUPS - 1); // 线性探测
+        if (groups[h].s == nullptr) {
+            if (used == RELEASE_GROUPS * 3 / 4) {
+                // 哈希表快满了，先把已经分好的组还回去
+                __release_groups(index, groups);
+                memset(groups, 0, sizeof(groups));
+                used = 0;
+                h = ((uintptr_t)cur_span / sizeof(span)) & (RELEASE_GROUPS - 1);
+            }
+            groups[h].s = cur_span;
+            groups[h].tail = start;
+            ++used;
+        }
+        free_list::__next_obj(start) = groups[h].head;
+        groups[h].head = start;
+        ++groups[h].n;
+        start = next;
+    }
+    if (used > 0)
+        __release_groups(index, groups);
+}
+
+void central_cache::__release_groups(size_t index, span_group* groups) {
+    span* empty_spans[RELEASE_GROUPS];
+    size_t n_empty = 0;
+    __span_lists[index].__bucket_mtx.lock();
+    for (size_t i = 0; i < RELEASE_GROUPS; i++) {
+        span* cur_span = groups[i].s;
+        if (cur_span == nullptr)
+            continue;
+        if (cur_span->__free_list == nullptr) {
+            // 之前是满的，现在有空闲对象了，挪回非空链表
+            __full_lists[index].erase(cur_span);
+            __span_lists[index].push_front(cur_span);
+        }
+        // 整组一次挂到span的自由链表上
+        free_list::__next_obj(groups[i].tail) = cur_span->__free_list;
+        cur_span->__free_list = groups[i].head;
         // 处理usecount
-        cur_span->__use_count--;
+        cur_span->__use_count -= groups[i].n;
+        __stats[index].out_objs.fetch_sub(groups[i].n, std::memory_order_relaxed);
         if (cur_span->__use_count == 0) {
-            // 说明这个span切分出去的所有小块都回来了
-            // 归还给pagecache
-            // 1. 把这一页从cc的这个桶的spanlist中拿掉
-            // #ifdef PROJECT_DEBUG
-            //             LOG(DEBUG) << "***" << std::endl;
-            // #endif
-            __span_lists[index].erase(cur_span); // 从桶里面拿走
-            // #ifdef PROJECT_DEBUG
-            //             LOG(DEBUG) << "after ***" << std::endl;
-            // #endif
-            // 2. 此时不用管这个span的freelist了，因为这些内存本来就是span初始地址后面的，然后顺序也是乱的，直接置空即可
-            //      (这里还不太理解)
+            size_t bytes = cur_span->__n << PAGE_SHIFT;
+            __stats[index].span_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+            __stats[index].capacity_objs.fetch_sub(bytes / size_class::bucket_size(index), std::memory_order_relaxed);
+            // 说明这个span切分出去的所有小块都回来了，从桶里面拿走，等下还给pagecache
+            __span_lists[index].erase(cur_span);
+            // 此时不用管这个span的freelist了，因为这些内存本来就是span初始地址后面的，然后顺序也是乱的，直接置空即可
             cur_span->__free_list = nullptr;
             cur_span->__next = cur_span->__prev = nullptr;
             // 页号，页数是不能动的！
-            // 3. 解开桶锁
-            __span_lists[index].__bucket_mtx.unlock();
-            // 4. 还给pc
-            page_cache::get_instance()->__page_mtx.lock();
-            page_cache::get_instance()->release_span_to_page(cur_span);
-            page_cache::get_instance()->__page_mtx.unlock();
-            // 5. 恢复桶锁
-            __span_lists[index].__bucket_mtx.lock();
+            empty_spans[n_empty++] = cur_span;
         }
-        start = next;
     }
     __span_lists[index].__bucket_mtx.unlock();
-}
\ No newline at end of file
+    if (n_empty == 0)
+        return;
+    // 空了的span一次性还给pc，同一个分片只加一次锁(同一个桶的span一般都来自同一个分片)
+    page_heap* heap = nullptr;
+    for (size_t i = 0; i < n_empty; i++) {
+        page_heap* owner = page_cache::get_instance()->heap_of(empty_spans[i]);
+        if (owner != heap) {
+            if (heap)
+                heap->__page_mtx.unlock();
+            heap = owner;
+            heap->__page_mtx.lock();
+        }
+        heap->release_span_to_page(empty_spans[i]);
+    }
+    heap->__page_mtx.unlock();
+}
+
+void central_cache::release_range(void* start, void* end, size_t n, size_t size) {
+    size_t index = size_class::bucket_index(size);
+    size_t max_objs = std::max(size_class::num_move_size(size), TRANSFER_CACHE_BYTES / size);
+    if (__transfer_caches[index].insert_range(start, end, n, max_objs))
+        return;
+    // transfer cache满了，老老实实拆回span
+    release_list_to_spans(start, size);
+}
+
+void central_cache::drain_transfer_caches() {
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        void* start = nullptr;
+        void* end = nullptr;
+        while (__transfer_caches[i].pop_batch(start, end) > 0)
+            release_list_to_spans(start, size_class::bucket_size(i));
+    }
+}
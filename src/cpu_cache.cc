@@ -0,0 +1,281 @@
+
+#include "../include/cpu_cache.hpp"
+#include "../include/central_cache.hpp"
+#include "../include/log.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#include <fcntl.h>
+#include <sys/rseq.h>
+#include <unistd.h>
+#define __YUFC_HAVE_RSEQ__ 1
+#endif
+
+#ifdef __YUFC_HAVE_RSEQ__
+// glibc给当前线程注册的struct rseq
+static inline struct rseq* __rseq_abi() {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// rseq临界区的写法:
+//  1. 先把临界区描述符(rseq_cs: 开始地址，长度，abort地址)写到rseq->rseq_cs
+//  2. 在[1, 2)之间读cpu_id_start，算出本CPU的区域，做完所有的读和准备工作
+//  3. 最后一条指令才是真正的提交(一次store)
+//  4. 临界区里被抢占/迁移/信号打断，内核会跳到abort(4)，abort前面必须是注册时的签名
+//      abort直接跳回0重新开始
+#define __RSEQ_CS_BEGIN                                   \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                  \
+    ".balign 32\n\t"                                      \
+    "3:\n\t"                                              \
+    ".long 0x0, 0x0\n\t"                                  \
+    ".quad 1f, (2f - 1f), 4f\n\t"                         \
+    ".popsection\n\t"                                     \
+    "0:\n\t"                                              \
+    "leaq 3b(%%rip), %%rax\n\t"                           \
+    "movq %%rax, 8(%[rseq])\n\t"                          \
+    "1:\n\t"
+
+#define __RSEQ_CS_END                                     \
+    "2:\n\t"                                              \
+    ".pushsection __rseq_failure, \"ax\"\n\t"             \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                          \
+    ".long 0x53053053\n\t" /* RSEQ_SIG */                 \
+    "4:\n\t"                                              \
+    "jmp 0b\n\t"                                          \
+    ".popsection\n\t"
+#endif
+
+void cpu_cache::__init() {
+    std::lock_guard<std::mutex> lock(__init_mtx);
+    if (__active >= 0)
+        return;
+#ifdef __YUFC_HAVE_RSEQ__
+    const char* env = getenv("TCMALLOC_PER_CPU_CACHES"); // getenv不会调用malloc
+    if (env == nullptr || env[0] != '1' || __rseq_size == 0 || (int)__rseq_abi()->cpu_id < 0) {
+        __active = 0;
+        return;
+    }
+    // 算每个桶的容量和在区域里的位置，header放在最前面
+    size_t slot = BUCKETS_NUM * sizeof(slab_header) / sizeof(void*);
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        size_t size = size_class::bucket_size(i);
+        size_t cap = std::min(size_class::num_move_size(size), PER_CPU_CLASS_BYTES / size);
+        __capacity[i] = (uint32_t)std::max(cap, (size_t)1);
+        __slot_begin[i] = slot;
+        slot += __capacity[i];
+    }
+    __region_size = size_class::__round_up(slot * sizeof(void*), 1 << PAGE_SHIFT);
+    // 所有CPU的区域一次要好，没用到的CPU不会碰这些页，不占物理内存
+    // 只按机器上可能有的CPU个数要，不按MAX_CPUS要，不然核少的机器上元数据白白多出几十MB
+    __num_cpus = __possible_cpus();
+    __region = (char*)system_alloc((__region_size * __num_cpus) >> PAGE_SHIFT);
+    system_stats::get_instance()->add_metadata(__region_size * __num_cpus);
+    __active = 1;
+#else
+    __active = 0;
+#endif
+}
+
+void cpu_cache::__init_cpu(size_t cpu) {
+    slab_header* hdr = (slab_header*)(__region + cpu * __region_size);
+    // 最后一个桶的end是最后写的，它不为0说明整个CPU都初始化好了，不用拿全局的锁
+    if (__atomic_load_n(&hdr[BUCKETS_NUM - 1].end, __ATOMIC_ACQUIRE) != 0)
+        return;
+    std::lock_guard<std::mutex> lock(__init_mtx);
+    if (hdr[BUCKETS_NUM - 1].end != 0)
+        return;
+    // 先写好current再写end: end不为0之后别的线程的rseq临界区才会用这个桶
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        hdr[i].current = 0;
+        __atomic_store_n(&hdr[i].end, __capacity[i], __ATOMIC_RELEASE);
+    }
+}
+
+size_t cpu_cache::__current_cpu() {
+#ifdef __YUFC_HAVE_RSEQ__
+    return __rseq_abi()->cpu_id_start;
+#else
+    return 0;
+#endif
+}
+
+size_t cpu_cache::__possible_cpus() {
+    // /sys/devices/system/cpu/possible里是"0-7"这样的，最后一个编号加一就是个数
+    // 不能用sysconf: glibc里面要opendir，会调malloc，这时候malloc就是我们自己
+#ifdef __YUFC_HAVE_RSEQ__
+    int fd = open("/sys/devices/system/cpu/possible", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return MAX_CPUS;
+    char buf[64];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len <= 0 || len == (ssize_t)sizeof(buf)) // 没读到，或者太长读不完
+        return MAX_CPUS;
+    size_t last = 0;
+    bool in_num = false;
+    for (ssize_t i = 0; i < len; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            last = (in_num ? last * 10 : 0) + (buf[i] - '0');
+            in_num = true;
+        } else {
+            in_num = false;
+        }
+    }
+    return std::min(last + 1, MAX_CPUS);
+#else
+    return MAX_CPUS;
+#endif
+}
+
+void* cpu_cache::__pop(size_t index) {
+#ifdef __YUFC_HAVE_RSEQ__
+    void* result;
+    __asm__ __volatile__(
+        __RSEQ_CS_BEGIN
+        "xorq %[result], %[result]\n\t"
+        "movl (%[rseq]), %%eax\n\t" // cpu_id_start
+        "cmpq %[max_cpus], %%rax\n\t"
+        "jae 2f\n\t"
+        "imulq %[region_size], %%rax\n\t"
+        "addq %[region], %%rax\n\t" // rax = 本CPU的区域
+        "movl (%%rax, %[index], 8), %%ecx\n\t" // header.current
+        "testl %%ecx, %%ecx\n\t"
+        "jz 2f\n\t" // 空了
+        "subl $1, %%ecx\n\t"
+        "leaq (%[slot], %%rcx), %%rdx\n\t"
+        "movq (%%rax, %%rdx, 8), %[result]\n\t"
+        "movl %%ecx, (%%rax, %[index], 8)\n\t" // 提交: current - 1
+        __RSEQ_CS_END
+        : [result] "=&r"(result)
+        : [rseq] "r"(__rseq_abi()), [max_cpus] "r"((uint64_t)__num_cpus),
+        [region_size] "r"((uint64_t)__region_size), [region] "r"(__region),
+        [index] "r"((uint64_t)index), [slot] "r"((uint64_t)__slot_begin[index])
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return result;
+#else
+    return nullptr;
+#endif
+}
+
+bool cpu_cache::__push(size_t index, void* ptr) {
+#ifdef __YUFC_HAVE_RSEQ__
+    uint64_t ok;
+    __asm__ __volatile__(
+        __RSEQ_CS_BEGIN
+        "xorq %[ok], %[ok]\n\t"
+        "movl (%[rseq]), %%eax\n\t" // cpu_id_start
+        "cmpq %[max_cpus], %%rax\n\t"
+        "jae 2f\n\t"
+        "imulq %[region_size], %%rax\n\t"
+        "addq %[region], %%rax\n\t" // rax = 本CPU的区域
+        "movl (%%rax, %[index], 8), %%ecx\n\t" // header.current
+        "cmpl 4(%%rax, %[index], 8), %%ecx\n\t" // header.end
+        "jae 2f\n\t" // 满了(或者这个CPU还没初始化)
+        "leaq (%[slot], %%rcx), %%rdx\n\t"
+        "movq %[ptr], (%%rax, %%rdx, 8)\n\t" // 写到空槽里，没提交之前别人看不到
+        "addl $1, %%ecx\n\t"
+        "movq $1, %[ok]\n\t"
+        "movl %%ecx, (%%rax, %[index], 8)\n\t" // 提交: current + 1
+        __RSEQ_CS_END
+        : [ok] "=&r"(ok)
+        : [rseq] "r"(__rseq_abi()), [max_cpus] "r"((uint64_t)__num_cpus),
+        [region_size] "r"((uint64_t)__region_size), [region] "r"(__region),
+        [index] "r"((uint64_t)index), [slot] "r"((uint64_t)__slot_begin[index]), [ptr] "r"(ptr)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return ok != 0;
+#else
+    return false;
+#endif
+}
+
+void* cpu_cache::allocate(size_t size) {
+    assert(size <= MAX_BYTES);
+    size_t index = size_class::bucket_index(size);
+    void* ptr = __pop(index);
+    if (ptr != nullptr)
+        return ptr;
+    return __refill(index, size_class::round_up(size));
+}
+
+void cpu_cache::deallocate(void* ptr, size_t size) {
+    assert(ptr);
+    assert(size <= MAX_BYTES);
+    size_t index = size_class::bucket_index(size);
+    if (__push(index, ptr))
+        return;
+    __drain(index, ptr, size_class::bucket_size(index));
+}
+
+void* cpu_cache::__refill(size_t index, size_t size) {
+    size_t cpu = __current_cpu();
+    if (cpu < __num_cpus)
+        __init_cpu(cpu);
+    // 一次要半个桶的量，第一个直接返回，剩下的放进当前CPU
+    size_t batch_num = std::max((size_t)__capacity[index] / 2, (size_t)1);
+    void* start = nullptr;
+    void* end = nullptr;
+#ifdef PROJECT_DEBUG
+    LOG(DEBUG) << "cpu_cache::__refill call central_cache::get_instance()->fetch_range_obj()" << std::endl;
+#endif
+    central_cache::get_instance()->fetch_range_obj(start, end, batch_num, size);
+    void* ret = start;
+    void* cur = free_list::__next_obj(start);
+    while (cur != nullptr) {
+        void* next = free_list::__next_obj(cur);
+        if (!__push(index, cur)) {
+            // 放不下了(被迁移到了别的CPU，或者CPU号太大)，剩下的还回去
+            central_cache::get_instance()->release_list_to_spans(cur, size);
+            break;
+        }
+        cur = next;
+    }
+    return ret;
+}
+
+void cpu_cache::__drain(size_t index, void* ptr, size_t size) {
+    size_t cpu = __current_cpu();
+    if (cpu < __num_cpus) {
+        slab_header* hdr = (slab_header*)(__region + cpu * __region_size);
+        if (__atomic_load_n(&hdr[index].end, __ATOMIC_ACQUIRE) == 0) {
+            // 这个CPU第一次用，初始化之后再试一次
+            __init_cpu(cpu);
+            if (__push(index, ptr))
+                return;
+        }
+    }
+    // 桶满了: 拿出一半，和ptr一起还给centralCache
+    free_list::__next_obj(ptr) = nullptr;
+    void* end = ptr;
+    size_t n = 1;
+    size_t half = std::max((size_t)__capacity[index] / 2, (size_t)1);
+    for (; n <= half; n++) {
+        void* obj = __pop(index);
+        if (obj == nullptr)
+            break;
+        free_list::__next_obj(obj) = ptr;
+        ptr = obj;
+    }
+#ifdef PROJECT_DEBUG
+    LOG(DEBUG) << "cpu_cache::__drain call central_cache::get_instance()->release_range()" << std::endl;
+#endif
+    central_cache::get_instance()->release_range(ptr, end, n, size);
+}
+
+size_t cpu_cache::get_stats(size_t* objs) {
+    if (__active != 1)
+        return 0;
+    size_t bytes = 0;
+    for (size_t cpu = 0; cpu < __num_cpus; cpu++) {
+        slab_header* hdr = (slab_header*)(__region + cpu * __region_size);
+        if (__atomic_load_n(&hdr[0].end, __ATOMIC_ACQUIRE) == 0)
+            continue; // 这个CPU没用过
+        for (size_t i = 0; i < BUCKETS_NUM; i++) {
+            size_t n = __atomic_load_n(&hdr[i].current, __ATOMIC_RELAXED);
+            objs[i] += n;
+            bytes += n * size_class::bucket_size(i);
+        }
+    }
+    return bytes;
+}
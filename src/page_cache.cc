@@ -1,34 +1,137 @@
 
 #include "../include/page_cache.hpp"
+#include "../include/central_cache.hpp"
 #include "../include/log.hpp"
+#include <atomic>
+#include <chrono>
+#include <thread>
 
-page_cache page_cache::__s_inst;
+page_cache::page_cache()
+    : __release_rate(DEFAULT_RELEASE_RATE)
+    , __scavenger_started(false) {
+    for (size_t i = 0; i < PAGE_SHARDS; i++)
+        __heaps[i].init(i + 1, &__id_span_map, &__map_mtx, &__large_cache);
+    __heaps[SAMPLED_HEAP].init(SAMPLED_HEAP + 1, &__id_span_map, &__map_mtx, nullptr, true);
+}
+
+size_t page_cache::release_memory(size_t bytes, bool break_hugepages) {
+    // 用户要求还内存的时候才拆transfer cache: 里面的对象会让它们的span一直还不回pc
+    // 后台回收不拆，活着的线程还要从transfer cache里补货
+    central_cache::get_instance()->drain_transfer_caches();
+    return __release_pages(bytes, break_hugepages);
+}
+
+size_t page_cache::__release_pages(size_t bytes, bool break_hugepages) {
+    size_t pages = size_class::__round_up(bytes, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+    size_t released = __large_cache.release(pages);
+    for (size_t i = 0; i < PAGE_SHARDS + 1 && released < pages; i++) {
+        std::lock_guard<std::mutex> lock(__heaps[i].__page_mtx);
+        released += __heaps[i].release_at_least_n_pages(pages - released, break_hugepages);
+    }
+    return released << PAGE_SHIFT;
+}
+
+void page_cache::get_stats(size_t& free_pages, size_t& returned_pages, size_t& in_use_pages, size_t& sampled_pages) {
+    free_pages = returned_pages = in_use_pages = sampled_pages = 0;
+    for (size_t i = 0; i < PAGE_SHARDS + 1; i++) {
+        std::lock_guard<std::mutex> lock(__heaps[i].__page_mtx);
+        free_pages += __heaps[i].free_pages();
+        returned_pages += __heaps[i].returned_pages();
+        if (i == SAMPLED_HEAP)
+            sampled_pages = __heaps[i].in_use_pages();
+        else
+            in_use_pages += __heaps[i].in_use_pages();
+    }
+    free_pages += __large_cache.cached_pages();
+}
+
+void page_cache::start_scavenger(size_t bytes_per_second) {
+    if (__scavenger_started.exchange(true))
+        return;
+    std::thread([this, bytes_per_second]() {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            __large_cache.release_idle(); // 没有大内存申请释放的时候大span缓存不会自己检查
+            __release_pages(bytes_per_second, false);
+        }
+    }).detach();
+}
+
+page_heap* page_cache::heap_for_thread() {
+    static std::atomic<size_t> next_shard(0);
+    static __thread size_t tls_shard = 0; // 0表示还没分配
+    if (tls_shard == 0)
+        tls_shard = next_shard.fetch_add(1) % PAGE_SHARDS + 1;
+    return &__heaps[tls_shard - 1];
+}
+
+void page_heap::init(size_t shard_id, id_span_map* map, std::mutex* map_mtx, large_span_cache* large_cache, bool sampled) {
+    __shard_id = shard_id;
+    __id_span_map = map;
+    __map_mtx = map_mtx;
+    __large_cache = large_cache;
+    __sampled = sampled;
+}
+
+void* page_heap::__system_alloc(size_t k, size_t align) {
+#if defined(__linux__)
+    if (__sampled) {
+        void* ptr = system_region::sampled_instance()->commit(k, align);
+        if (ptr != nullptr)
+            system_stats::get_instance()->add_system(k << PAGE_SHIFT);
+        return ptr;
+    }
+#endif
+    return system_alloc(k, align);
+}
+
+void page_heap::__system_free(void* ptr, size_t k) {
+#if defined(__linux__)
+    if (__sampled) {
+        // 采样的地址空间只预留一次，还回去的地址段不能丢，不然采样用不了多久就用完了
+        system_region::sampled_instance()->release(ptr, k << PAGE_SHIFT);
+        system_stats::get_instance()->sub_system(k << PAGE_SHIFT);
+        return;
+    }
+#endif
+    system_free(ptr, k << PAGE_SHIFT);
+}
+
+span* page_heap::__new_span_obj() {
+    span* s = __span_pool.new_();
+    s->__shard = __shard_id;
+    return s;
+}
 
 // cc向pc获取k页的span
-span* page_cache::new_span(size_t k) {
+span* page_heap::new_span(size_t k) {
     assert(k > 0);
-    // 处理大内存情况
+    // 处理大内存情况: 先看看大span缓存里有没有差不多大的
     if (k > PAGES_NUM - 1) {
-        void* ptr = system_alloc(k);
-        span* cur_span = __span_pool.new_();
-        cur_span->__page_id = (PAGE_ID)ptr >> PAGE_SHIFT;
-        cur_span->__n = k;
-        // map记录一下
-        // __id_span_map[cur_span->__page_id] = cur_span;
-        __id_span_map.set(cur_span->__page_id, cur_span);
-        return cur_span;
+        PAGE_ID id = 0;
+        size_t n = 0;
+        if (__large_cache == nullptr || !__large_cache->pop(k, id, n))
+            return __new_system_span(k, (size_t)1 << PAGE_SHIFT);
+        span* s = __new_span_obj();
+        s->__page_id = id;
+        s->__n = n;
+        __id_span_map->set(id, s); // radix树的节点第一次找系统要的时候就建好了
+        __in_use_pages += n;
+        return s;
     }
     // 先检查第k个桶是否有span
     // #ifdef PROJECT_DEBUG
     //     LOG(DEBUG) << "before ***" << std::endl;
     // #endif
-    if (!__span_lists[k].empty()) {
-        span* s = __span_lists[k].pop_front(); // ? __span_lists->pop_front();
+    span* s = __pop_free_span(k);
+    if (s != nullptr) {
+        s->__returned_n = 0;
         // 建立id和span的映射，方便central cache回收小块内存时，查找对应的span
         for (PAGE_ID i = 0; i < s->__n; ++i) {
             // __id_span_map[s->__page_id + i] = s;
-            __id_span_map.set(s->__page_id + i, s);
+            __id_span_map->set(s->__page_id + i, s);
         }
+        __in_use_pages += s->__n;
         return s;
     }
     // #ifdef PROJECT_DEBUG
@@ -36,12 +139,12 @@ span* page_cache::new_span(size_t k) {
     // #endif
     // 第k个桶是空的->去检查后面的桶里面有无span，如果有，可以把它进行切分
     for (size_t i = k + 1; i < PAGES_NUM; i++) {
-        if (!__span_lists[i].empty()) {
+        span* n_span = __pop_free_span(i);
+        if (n_span != nullptr) {
             // 可以开始切了
             // 假设这个页是n页的，需要的是k页的
             // 1. 从__span_lists中拿下来 2. 切开 3. 一个返回给cc 4. 另一个挂到 n-k 号桶里面去
-            span* n_span = __span_lists[i].pop_front();
-            span* k_span = __span_pool.new_();
+            span* k_span = __new_span_obj();
             // 在n_span头部切除k页下来
             k_span->__page_id = n_span->__page_id; // <1>
             k_span->__n = k; // <2>
@@ -55,37 +158,228 @@ span* page_cache::new_span(size_t k) {
              * 切出来之后n_span就是从102开始了，所以 <3>
              * 切出来之后n_span就变成__n-k页了，所以 <4>
              */
-            // 剩下的挂到相应位置
-            __span_lists[n_span->__n].push_front(n_span);
+            // 剩下的挂到相应位置: 不知道还掉的是具体哪几页，还掉的页数按比例分给剩下的这一段
+            n_span->__returned_n = (uint32_t)(n_span->__returned_n * n_span->__n / (n_span->__n + k));
+            __push_free_span(n_span);
             // 存储n_span的首尾页号跟n_span的映射，方便pc回收内存时进行合并查找
             // __id_span_map[n_span->__page_id] = n_span;
-            __id_span_map.set(n_span->__page_id, n_span);
+            __id_span_map->set(n_span->__page_id, n_span);
             // __id_span_map[n_span->__page_id + n_span->__n - 1] = n_span;
-            __id_span_map.set(n_span->__page_id + n_span->__n - 1, n_span);
+            __id_span_map->set(n_span->__page_id + n_span->__n - 1, n_span);
             // 这里记录映射(简历id和span的映射，方便cc回收小块内存时，查找对应的span)
             for (PAGE_ID j = 0; j < k_span->__n; j++) {
                 // __id_span_map[k_span->__page_id + j] = k_span;
-                __id_span_map.set(k_span->__page_id + j, k_span);
+                __id_span_map->set(k_span->__page_id + j, k_span);
             }
 #ifdef PROJECT_DEBUG
-            LOG(DEBUG) << "page_cache::new_span() have span, return" << std::endl;
+            LOG(DEBUG) << "page_heap::new_span() have span, return" << std::endl;
 #endif
+            __in_use_pages += k_span->__n;
             return k_span;
         }
     }
 #ifdef PROJECT_DEBUG
-    LOG(DEBUG) << "page_cache::new_span() cannot find span, goto os for mem" << std::endl;
+    LOG(DEBUG) << "page_heap::new_span() cannot find span, goto os for mem" << std::endl;
 #endif
-    // 走到这里，说明找不到span了：找os要
-    span* big_span = __span_pool.new_();
-    void* ptr = system_alloc(PAGES_NUM - 1);
-    big_span->__page_id = (PAGE_ID)ptr >> PAGE_SHIFT;
-    big_span->__n = PAGES_NUM - 1;
-    // 挂到上面去
-    __span_lists[PAGES_NUM - 1].push_front(big_span);
+    // 走到这里，说明找不到span了：找os要一个2MB对齐的大页，切成几个128页的span挂上去
+    static_assert(HUGEPAGE_PAGES % (PAGES_NUM - 1) == 0, "a hugepage must hold whole 128-page spans");
+    void* ptr = __system_alloc(HUGEPAGE_PAGES, HUGEPAGE_SIZE);
+    if (ptr == nullptr)
+        return nullptr;
+    PAGE_ID start = (PAGE_ID)ptr >> PAGE_SHIFT;
+    {
+        std::lock_guard<std::mutex> lock(*__map_mtx);
+        __id_span_map->Ensure(start, HUGEPAGE_PAGES); // 新拿到的页，先把radix树的节点建出来
+    }
+    for (PAGE_ID id = start; id < start + HUGEPAGE_PAGES; id += PAGES_NUM - 1) {
+        span* big_span = __new_span_obj();
+        big_span->__page_id = id;
+        big_span->__n = PAGES_NUM - 1;
+        // 首尾页也要记一下，判断大页是不是整个空闲的时候要用
+        __id_span_map->set(big_span->__page_id, big_span);
+        __id_span_map->set(big_span->__page_id + big_span->__n - 1, big_span);
+        // 挂到上面去
+        __span_lists[PAGES_NUM - 1].push_front(big_span);
+        __free_pages += big_span->__n;
+    }
     return new_span(k);
 }
 
+span* page_heap::__new_system_span(size_t k, size_t align) {
+    void* ptr = __system_alloc(k, align);
+    if (ptr == nullptr)
+        return nullptr;
+    span* cur_span = __new_span_obj();
+    cur_span->__page_id = (PAGE_ID)ptr >> PAGE_SHIFT;
+    cur_span->__n = k;
+    {
+        std::lock_guard<std::mutex> lock(*__map_mtx); // 各个分片会同时长radix树的节点
+        __id_span_map->Ensure(cur_span->__page_id, k); // 先把radix树的节点建出来
+    }
+    // map记录一下
+    // __id_span_map[cur_span->__page_id] = cur_span;
+    __id_span_map->set(cur_span->__page_id, cur_span);
+    __in_use_pages += k;
+    return cur_span;
+}
+
+span* page_heap::new_aligned_span(size_t k, size_t align_pages) {
+    assert(k > 0);
+    assert(align_pages > 0 && (align_pages & (align_pages - 1)) == 0);
+    size_t n = k + align_pages - 1; // 多要align_pages - 1页，里面一定有一段对齐的k页
+    if (n > PAGES_NUM - 1)
+        return __new_system_span(k, align_pages << PAGE_SHIFT); // pc里没有这么大的span，直接找系统要对齐的
+    span* s = new_span(n);
+    if (s == nullptr)
+        return nullptr;
+    PAGE_ID aligned = (s->__page_id + align_pages - 1) & ~(PAGE_ID)(align_pages - 1);
+    size_t lead = aligned - s->__page_id;
+    size_t trail = s->__n - lead - k;
+    s->__page_id = aligned;
+    s->__n = k;
+    s->__is_use = true; // 头尾还回去的时候不能把它合并掉
+    // 头尾多出来的页还回去
+    if (lead > 0)
+        __release_piece(aligned - lead, lead);
+    if (trail > 0)
+        __release_piece(aligned + k, trail);
+    return s;
+}
+
+void page_heap::__release_piece(PAGE_ID id, size_t n) {
+    span* piece = __new_span_obj();
+    piece->__page_id = id;
+    piece->__n = n;
+    // new_span的时候这些页都映射到了原来的span上，先改过来
+    for (PAGE_ID i = 0; i < n; i++)
+        __id_span_map->set(id + i, piece);
+    release_span_to_page(piece);
+}
+
+span* page_heap::__pop_free_span(size_t i) {
+    if (!__span_lists[i].empty()) {
+        span* s = __span_lists[i].begin();
+        if (i == PAGES_NUM - 1) {
+            // 128页的span可能是一个完整空闲大页的一半，尽量先用已经被用了一部分的大页，完整的大页留着
+            size_t scanned = 0;
+            for (span* cur = __span_lists[i].begin(); cur != __span_lists[i].end() && scanned < HUGEPAGE_SCAN_LIMIT;
+                 cur = cur->__next, scanned++) {
+                if (!__hugepage_free(__hugepage_start(cur->__page_id))) {
+                    s = cur;
+                    break;
+                }
+            }
+        }
+        __erase_free_span(s);
+        return s;
+    }
+    if (!__returned_lists[i].empty()) {
+        // 页已经还给操作系统了，地址还能直接用，第一次访问的时候系统会重新给页
+        span* s = __returned_lists[i].begin();
+        __erase_free_span(s); // __returned_n先不清，切分的时候剩下的那一段还要按它挂回去
+        return s;
+    }
+    return nullptr;
+}
+
+void page_heap::__push_free_span(span* s) {
+    if (s->__returned_n == s->__n)
+        __returned_lists[s->__n].push_front(s);
+    else
+        __span_lists[s->__n].push_front(s);
+    __free_pages += s->__n - s->__returned_n;
+    __returned_pages += s->__returned_n;
+}
+
+void page_heap::__erase_free_span(span* s) {
+    // erase只是解除连接，不用管在哪个链表上
+    __span_lists[s->__n].erase(s);
+    __free_pages -= s->__n - s->__returned_n;
+    __returned_pages -= s->__returned_n;
+}
+
+bool page_heap::__hugepage_free(PAGE_ID start) {
+    // 从大页的第一页开始一个span一个span地往后走，空闲span的首页一定有映射
+    PAGE_ID id = start;
+    bool resident = false;
+    while (id < start + HUGEPAGE_PAGES) {
+        span* s = (span*)__id_span_map->get(id);
+        if (s == nullptr || !__own(s) || s->__is_use || s->__page_id != id)
+            return false;
+        resident |= s->__returned_n < s->__n;
+        id += s->__n;
+    }
+    return resident;
+}
+
+size_t page_heap::__release_hugepages(size_t n) {
+    size_t released = 0;
+    span_list& list = __span_lists[PAGES_NUM - 1];
+    span* cur = list.end()->__prev; // 从最久没用过的开始看
+    size_t scanned = 0;
+    while (cur != list.end() && released < n && scanned++ < HUGEPAGE_SCAN_LIMIT) {
+        span* prev = cur->__prev;
+        PAGE_ID start = __hugepage_start(cur->__page_id);
+        if (__hugepage_free(start)) {
+            // 整个大页一次还掉，同一个大页的另一个span可能就是prev，要重新找prev
+            PAGE_ID id = start;
+            while (id < start + HUGEPAGE_PAGES) {
+                span* s = (span*)__id_span_map->get(id);
+                if (s == prev)
+                    prev = prev->__prev;
+                __erase_free_span(s);
+                released += s->__n - s->__returned_n; // 本来就还掉了的页不算
+                s->__returned_n = s->__n;
+                __push_free_span(s);
+                id += s->__n;
+            }
+            system_release((void*)(start << PAGE_SHIFT), HUGEPAGE_SIZE);
+        }
+        cur = prev;
+    }
+    return released;
+}
+
+size_t page_heap::release_at_least_n_pages(size_t n, bool break_hugepages) {
+    size_t released = __release_hugepages(n);
+    if (released >= n || !break_hugepages)
+        return released;
+    // 不够的话只能拆大页了
+    // 从大桶往小桶轮着还，每个桶还最久没用过的那个(链表尾巴)
+    for (size_t tried = 0; tried < PAGES_NUM - 1 && released < n; tried++) {
+        size_t i = __release_index;
+        __release_index = (i == 1) ? PAGES_NUM - 1 : i - 1;
+        while (!__span_lists[i].empty() && released < n) {
+            span* s = __span_lists[i].end()->__prev;
+            __erase_free_span(s);
+            system_release((void*)(s->__page_id << PAGE_SHIFT), s->__n << PAGE_SHIFT);
+            released += s->__n - s->__returned_n;
+            s->__returned_n = s->__n;
+            __push_free_span(s);
+        }
+    }
+    return released;
+}
+
+void page_heap::__incremental_scavenge(size_t n) {
+    __scavenge_counter -= n;
+    if (__scavenge_counter >= 0)
+        return;
+    size_t rate = page_cache::get_instance()->release_rate();
+    if (rate == 0) {
+        __scavenge_counter = RELEASE_DELAY_PAGES;
+        return;
+    }
+    size_t released = __release_hugepages(1); // 释放路径上只还完整的大页
+    if (released == 0) {
+        __scavenge_counter = RELEASE_DELAY_PAGES;
+        return;
+    }
+    // 还了released页，那么下一次要等再释放 released * 1000 / rate 页
+    long long wait = (long long)(released * 1000 / rate);
+    __scavenge_counter = std::min(wait, MAX_RELEASE_DELAY_PAGES);
+}
+
 span* page_cache::map_obj_to_span(void* obj) {
     // 先把页号算出来
     PAGE_ID id = (PAGE_ID)obj >> PAGE_SHIFT; // 这个理论推导可以自行推导一下
@@ -103,17 +397,26 @@ span* page_cache::map_obj_to_span(void* obj) {
     return ret;
 }
 
-void page_cache::release_span_to_page(span* s, size_t size) {
-    // 第二个参数是为了linux下一次释放大内存，需要大小
+void page_heap::release_span_to_page(span* s) {
     // std::cout << s->__n << std::endl; // 33
+    __in_use_pages -= s->__n;
     if (s->__n >= PAGES_NUM) {
-        // 处理大内存
-        void* ptr = (void*)(s->__page_id << PAGE_SHIFT);
-        system_free(s, size);
+        // 处理大内存: 先放进大span缓存，放不下再还给操作系统
+        // 先清掉映射: 放进缓存之后别的分片马上就可能拿走这些页，建自己的映射
+        __id_span_map->set(s->__page_id, nullptr); // 这个span对象马上要被复用了，不能再让别人通过页号找到它
+        if (__large_cache == nullptr || !__large_cache->push(s->__page_id, s->__n)) {
+            void* ptr = (void*)(s->__page_id << PAGE_SHIFT);
+            __system_free(ptr, s->__n); // 要还的是span管理的页，不是span对象本身
+        }
         // delete s;
         __span_pool.delete_(s);
         return;
     }
+    // 这些页不再属于任何桶了
+    for (PAGE_ID i = 0; i < s->__n; i++)
+        __id_span_map->set_sizeclass(s->__page_id + i, 0);
+    size_t freed_pages = s->__n; // 这次真正释放的页数，合并进来的本来就是空闲的
+    s->__returned_n = 0; // 刚用完的页都在内存里
     // 对span前后对页尝试进行合并，缓解内存碎片问题
     while (true) {
         PAGE_ID prev_id = s->__page_id - 1; // 前一块span的id一定是当前span的id-1
@@ -123,18 +426,25 @@ void page_cache::release_span_to_page(span* s, size_t size) {
         // auto ret = __id_span_map.find(prev_id);
         // if (ret == __id_span_map.end()) // 前面的页号没有了，不合并了
         //     break;
-        auto ret = (span*)__id_span_map.get(prev_id);
+        auto ret = (span*)__id_span_map->get(prev_id);
         if (ret == nullptr)
             break;
         // span* prev_span = ret->second;
         span* prev_span = ret;
+        if (!__own(prev_span)) // 别的分片的span，不归我们管
+            break;
         if (prev_span->__is_use == true) // 前面相邻页的span在使用，不合并了
             break;
+        if (prev_span->__page_id + prev_span->__n != s->__page_id) // 过期的映射(span对象已经被复用了)
+            break;
         if (prev_span->__n + s->__n > PAGES_NUM - 1) // 合并出超过128页的span没办法管理，不合并了
             break;
+        if (__hugepage_start(prev_id) != __hugepage_start(s->__page_id)) // 不跨大页合并
+            break;
+        __erase_free_span(prev_span); // 防止野指针，删掉
         s->__page_id = prev_span->__page_id;
         s->__n += prev_span->__n;
-        __span_lists[prev_span->__n].erase(prev_span); // 防止野指针，删掉
+        s->__returned_n += prev_span->__returned_n; // 还掉的页和常驻的页合到一起，还掉的页数跟着带过来
         // delete prev_span; // 删掉这个span
         __span_pool.delete_(prev_span); // 删掉这个span
     } // 向前合并的逻辑 while end;
@@ -143,27 +453,187 @@ void page_cache::release_span_to_page(span* s, size_t size) {
         // auto ret = __id_span_map.find(next_id);
         // if (ret == __id_span_map.end()) // 后面的页号没有了
         //     break;
-        auto ret = (span*)__id_span_map.get(next_id);
+        auto ret = (span*)__id_span_map->get(next_id);
         if (ret == nullptr)
             break;
         // span* next_span = ret->second;
         span* next_span = ret;
+        if (!__own(next_span)) // 别的分片的span，不归我们管
+            break;
         if (next_span->__is_use == true) // 后面相邻页的span在使用，不合并了
             break;
+        if (next_span->__page_id != next_id) // 过期的映射(span对象已经被复用了)
+            break;
         if (next_span->__n + s->__n > PAGES_NUM - 1) // 合并出超过128页的span没办法管理，不合并了
             break;
-        s->__page_id; // 起始页号不用变了，因为是向后合并
+        if (__hugepage_start(next_id) != __hugepage_start(s->__page_id)) // 不跨大页合并
+            break;
+        __erase_free_span(next_span); // 防止野指针，删掉
         s->__n += next_span->__n;
-        __span_lists[next_span->__n].erase(next_span); // 防止野指针，删掉
+        s->__returned_n += next_span->__returned_n;
         // delete next_span;
         __span_pool.delete_(next_span);
     }
     // 已经合并完成了，把东西挂起来
-    __span_lists[s->__n].push_front(s);
     s->__is_use = false;
+    __push_free_span(s);
     // 处理一下映射，方便别人找到我
     // __id_span_map[s->__page_id] = s;
     // __id_span_map[s->__page_id + s->__n - 1] = s;
-    __id_span_map.set(s->__page_id, s);
-    __id_span_map.set(s->__page_id + s->__n - 1, s);
-}
\ No newline at end of file
+    __id_span_map->set(s->__page_id, s);
+    __id_span_map->set(s->__page_id + s->__n - 1, s);
+    __incremental_scavenge(freed_pages);
+}
+
+large_span_cache::large_span_cache() {
+    for (size_t i = 0; i < LARGE_CACHE_BUCKETS; i++)
+        __buckets[i].prev = __buckets[i].next = &__buckets[i];
+}
+
+uint32_t large_span_cache::__now_ms() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void large_span_cache::__insert(entry* e) {
+    entry* head = &__buckets[__bucket(e->n)];
+    e->prev = head;
+    e->next = head->next;
+    head->next->prev = e;
+    head->next = e;
+    __cached_pages += e->n;
+}
+
+void large_span_cache::__unlink(entry* e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    __cached_pages -= e->n;
+}
+
+bool large_span_cache::pop(size_t k, PAGE_ID& id, size_t& n) {
+    std::lock_guard<std::mutex> lock(__mtx);
+    if (__cached_pages == 0)
+        return false;
+    __age(__now_ms());
+    // 能装下k页里面最小的; 后面桶里的都比前面桶里的大，一个桶里找到了就不用往后找了
+    entry* best = nullptr;
+    for (size_t i = __bucket(k); i < LARGE_CACHE_BUCKETS && best == nullptr; i++) {
+        for (entry* e = __buckets[i].next; e != &__buckets[i]; e = e->next) {
+            if (e->n >= k && (best == nullptr || e->n < best->n))
+                best = e;
+        }
+    }
+    if (best == nullptr)
+        return false;
+    __unlink(best);
+    id = best->page_id;
+    n = best->n;
+    if (n - k > k / 8) {
+        // 多出来的太多了，切下来: 够大的留在缓存里，不到128页的还给操作系统
+        PAGE_ID rest_id = id + k;
+        size_t rest = n - k;
+        n = k;
+        if (rest >= PAGES_NUM) {
+            best->page_id = rest_id;
+            best->n = rest;
+            __insert(best); // 时间不变，还是原来那一段放进来的时间
+            return true;
+        }
+        system_free((void*)(rest_id << PAGE_SHIFT), rest << PAGE_SHIFT);
+    }
+    __entry_pool.delete_(best);
+    return true;
+}
+
+bool large_span_cache::push(PAGE_ID id, size_t n) {
+    if ((n << PAGE_SHIFT) > LARGE_CACHE_MAX_SPAN_BYTES)
+        return false;
+    std::lock_guard<std::mutex> lock(__mtx);
+    uint32_t now = __now_ms();
+    __age(now);
+    // 和缓存里前后相邻的合并(切剩下的还能拼回去)，缓存里最多几十段，挨个看一遍就行
+    for (size_t i = 0; i < LARGE_CACHE_BUCKETS; i++) {
+        for (entry* e = __buckets[i].next; e != &__buckets[i];) {
+            entry* next = e->next;
+            if (e->page_id + e->n == id || id + n == e->page_id) {
+                id = std::min(id, e->page_id);
+                n += e->n;
+                __unlink(e);
+                __entry_pool.delete_(e);
+            }
+            e = next;
+        }
+    }
+    if ((n << PAGE_SHIFT) > LARGE_CACHE_BYTES) {
+        // 拼起来比整个缓存还大，直接还给操作系统
+        system_free((void*)(id << PAGE_SHIFT), n << PAGE_SHIFT);
+        return true;
+    }
+    while (((__cached_pages + n) << PAGE_SHIFT) > LARGE_CACHE_BYTES)
+        __evict_oldest();
+    entry* e = __entry_pool.new_();
+    e->page_id = id;
+    e->n = n;
+    e->free_time = now;
+    __insert(e);
+    return true;
+}
+
+size_t large_span_cache::__evict_oldest() {
+    // 每个桶的尾巴是这个桶里最老的，挑闲得最久的那个
+    uint32_t now = __now_ms();
+    entry* oldest = nullptr;
+    for (size_t i = 0; i < LARGE_CACHE_BUCKETS; i++) {
+        entry* e = __buckets[i].prev;
+        if (e == &__buckets[i])
+            continue;
+        if (oldest == nullptr || (uint32_t)(now - e->free_time) > (uint32_t)(now - oldest->free_time))
+            oldest = e;
+    }
+    if (oldest == nullptr)
+        return 0;
+    size_t n = oldest->n;
+    __unlink(oldest);
+    system_free((void*)(oldest->page_id << PAGE_SHIFT), n << PAGE_SHIFT);
+    __entry_pool.delete_(oldest);
+    return n;
+}
+
+void large_span_cache::__age(uint32_t now, bool force) {
+    // 不用每次都看，隔1/4个闲置时间看一次，最多晚这么久还
+    if (!force && (uint32_t)(now - __check_time) < LARGE_CACHE_IDLE_MS / 4)
+        return;
+    __check_time = now;
+    for (size_t i = 0; i < LARGE_CACHE_BUCKETS; i++) {
+        // 从尾巴(最老的)开始，遇到一个没闲够的，前面的都更新
+        while (__buckets[i].prev != &__buckets[i]) {
+            entry* e = __buckets[i].prev;
+            if ((uint32_t)(now - e->free_time) < LARGE_CACHE_IDLE_MS)
+                break;
+            __unlink(e);
+            system_free((void*)(e->page_id << PAGE_SHIFT), e->n << PAGE_SHIFT);
+            __entry_pool.delete_(e);
+        }
+    }
+}
+
+size_t large_span_cache::release(size_t pages) {
+    std::lock_guard<std::mutex> lock(__mtx);
+    size_t released = 0;
+    while (released < pages && __cached_pages > 0)
+        released += __evict_oldest();
+    return released;
+}
+
+size_t large_span_cache::release_idle() {
+    std::lock_guard<std::mutex> lock(__mtx);
+    size_t before = __cached_pages;
+    __age(__now_ms(), true);
+    return before - __cached_pages;
+}
+
+size_t large_span_cache::cached_pages() {
+    std::lock_guard<std::mutex> lock(__mtx);
+    return __cached_pages;
+}
@@ -0,0 +1,189 @@
+
+#include "../include/sampler.hpp"
+#include "../include/page_cache.hpp"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__) && defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+
+static __thread bool tls_sampler_inited = false; // 这个线程的计数器设置过没有
+static __thread bool tls_in_sampler = false; // backtrace第一次调用会malloc，不能在采样里面再采样
+static __thread uint64_t tls_rng = 0;
+
+heap_sampler::heap_sampler()
+    : __period(0) {
+    memset(__buckets, 0, sizeof(__buckets));
+#if defined(__linux__)
+    const char* env = getenv("TCMALLOC_SAMPLE_PARAMETER"); // getenv不会调用malloc
+    if (env != nullptr)
+        __period = strtoull(env, nullptr, 10);
+#endif
+}
+
+long long heap_sampler::__next_interval(size_t period) {
+    if (tls_rng == 0)
+        tls_rng = ((uint64_t)(uintptr_t)&tls_rng ^ (uint64_t)time(nullptr)) | 1;
+    // xorshift64
+    tls_rng ^= tls_rng << 13;
+    tls_rng ^= tls_rng >> 7;
+    tls_rng ^= tls_rng << 17;
+    // 均值为period的指数分布，u在(0, 1]
+    double u = ((tls_rng >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double interval = -log(u) * period;
+    if (interval < 1)
+        interval = 1;
+    if (interval > 1e15)
+        interval = 1e15;
+    return (long long)interval;
+}
+
+void* heap_sampler::sample(size_t size, long long& bytes_until_sample) {
+    if (tls_in_sampler)
+        return nullptr;
+    size_t period = __period.load(std::memory_order_relaxed);
+#if !defined(__linux__)
+    period = 0; // 采样的对象要放在单独的地址空间里，只有linux下有
+#endif
+    if (period == 0) {
+        bytes_until_sample = SAMPLE_RECHECK_BYTES;
+        return nullptr;
+    }
+    bytes_until_sample = __next_interval(period);
+    if (!tls_sampler_inited) {
+        // 计数器一开始是0，第一次分配不算
+        tls_sampler_inited = true;
+        return nullptr;
+    }
+    tls_in_sampler = true;
+    void* ptr = __allocate(size);
+    if (ptr != nullptr)
+        __record(ptr, size);
+    tls_in_sampler = false;
+    return ptr;
+}
+
+void* heap_sampler::__allocate(size_t size) {
+    // 每个样本单独一个span，释放的时候看地址就知道是不是样本，没被采样的对象释放的时候不用查表
+    size_t k_page = size_class::__round_up(size, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+    page_heap* heap = page_cache::get_instance()->sampled_heap();
+    heap->__page_mtx.lock();
+    span* cur_span = heap->new_span(k_page);
+    if (cur_span != nullptr) {
+        cur_span->__obj_size = std::max(size, MAX_BYTES + 1); // 不管多大都按大内存还给pc
+        cur_span->__is_use = true;
+    }
+    heap->__page_mtx.unlock();
+    if (cur_span == nullptr)
+        return nullptr; // 采样的地址空间用完了，这次就不采样了
+    return (void*)(cur_span->__page_id << PAGE_SHIFT);
+}
+
+__attribute__((noinline)) void heap_sampler::__record(void* ptr, size_t size) {
+    void* stack[MAX_STACK_DEPTH + 2];
+    int depth = 0;
+#if defined(__linux__) && defined(__GLIBC__)
+    depth = backtrace(stack, MAX_STACK_DEPTH + 2);
+#endif
+    const int skip = 2; // __record和sample自己
+    std::lock_guard<std::mutex> lock(__mtx);
+    sample_record* rec = __record_pool.new_();
+    rec->ptr = ptr;
+    rec->size = size;
+    rec->depth = depth > skip ? depth - skip : 0;
+    memcpy(rec->stack, stack + skip, rec->depth * sizeof(void*));
+    size_t h = __hash(ptr);
+    rec->next = __buckets[h];
+    __buckets[h] = rec;
+}
+
+void heap_sampler::remove(void* ptr) {
+    std::lock_guard<std::mutex> lock(__mtx);
+    sample_record** cur = &__buckets[__hash(ptr)];
+    while (*cur != nullptr) {
+        if ((*cur)->ptr == ptr) {
+            sample_record* rec = *cur;
+            *cur = rec->next;
+            __record_pool.delete_(rec);
+            return;
+        }
+        cur = &(*cur)->next;
+    }
+}
+
+static bool __write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool heap_sampler::dump(int fd) {
+    // 格式和gperftools的heap profile一样:
+    //  heap profile: <存活个数>: <存活字节> [<分配个数>: <分配字节>] @ heap_v2/<采样间隔>
+    //  每个样本一行，后面是调用栈
+    //  最后是MAPPED_LIBRARIES: 加上/proc/self/maps，pprof用来找符号
+    // 样本的个数和字节pprof会按采样间隔自己还原
+    char line[64 + MAX_STACK_DEPTH * 20];
+    bool ok = true;
+    {
+        std::lock_guard<std::mutex> lock(__mtx);
+        size_t count = 0;
+        size_t bytes = 0;
+        for (size_t i = 0; i < SAMPLE_BUCKETS; i++) {
+            for (sample_record* rec = __buckets[i]; rec != nullptr; rec = rec->next) {
+                ++count;
+                bytes += rec->size;
+            }
+        }
+        int n = snprintf(line, sizeof(line), "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+            count, bytes, count, bytes, period());
+        ok = __write_all(fd, line, n);
+        for (size_t i = 0; i < SAMPLE_BUCKETS && ok; i++) {
+            for (sample_record* rec = __buckets[i]; rec != nullptr && ok; rec = rec->next) {
+                n = snprintf(line, sizeof(line), "%6d: %8zu [%6d: %8zu] @", 1, rec->size, 1, rec->size);
+                for (int d = 0; d < rec->depth; d++)
+                    n += snprintf(line + n, sizeof(line) - n, " %p", rec->stack[d]);
+                n += snprintf(line + n, sizeof(line) - n, "\n");
+                ok = __write_all(fd, line, n);
+            }
+        }
+    }
+    if (!ok)
+        return false;
+    const char* maps_header = "\nMAPPED_LIBRARIES:\n";
+    if (!__write_all(fd, maps_header, strlen(maps_header)))
+        return false;
+#if defined(__linux__)
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps < 0)
+        return false;
+    ssize_t n;
+    while (ok && (n = read(maps, line, sizeof(line))) > 0)
+        ok = __write_all(fd, line, n);
+    close(maps);
+#endif
+    return ok;
+}
+
+void tcmalloc_set_sample_period(size_t bytes) {
+    heap_sampler::get_instance()->set_period(bytes);
+}
+
+bool tcmalloc_dump_heap_profile(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = heap_sampler::get_instance()->dump(fd);
+    close(fd);
+    return ok;
+}
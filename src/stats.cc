@@ -0,0 +1,103 @@
+
+#include "../include/stats.hpp"
+#include "../include/central_cache.hpp"
+#include "../include/cpu_cache.hpp"
+#include "../include/page_cache.hpp"
+#include "../include/thread_cache.hpp"
+#include <stdarg.h>
+#include <stdio.h>
+
+// 各个计数不是同一时刻读的，相减可能是负数，按0算
+static inline size_t __sub_or_zero(size_t a, size_t b) {
+    return a > b ? a - b : 0;
+}
+
+void tcmalloc_get_stats(tc_stats* stats) {
+    *stats = tc_stats();
+    size_t thread_objs[BUCKETS_NUM] = { 0 };
+    size_t cpu_objs[BUCKETS_NUM] = { 0 };
+    stats->thread_cache_bytes = thread_cache::get_stats(thread_objs);
+    stats->cpu_cache_bytes = cpu_cache::get_instance()->get_stats(cpu_objs);
+    size_t small_span_bytes = 0;
+    size_t small_in_use_bytes = 0;
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        tc_class_stats& cs = stats->classes[i];
+        size_t capacity_objs = 0;
+        size_t out_objs = 0;
+        cs.obj_size = size_class::bucket_size(i);
+        central_cache::get_instance()->get_class_stats(i, cs.span_bytes, capacity_objs, out_objs, cs.transfer_objs);
+        cs.central_objs = __sub_or_zero(capacity_objs, out_objs);
+        cs.thread_objs = thread_objs[i];
+        cs.cpu_objs = cpu_objs[i];
+        // 从span里拿出去的对象，不在各级缓存里的就是程序正在用的
+        cs.in_use_objs = __sub_or_zero(out_objs, cs.transfer_objs + cs.thread_objs + cs.cpu_objs);
+        cs.fragmentation_bytes = __sub_or_zero(cs.span_bytes, cs.in_use_objs * cs.obj_size);
+        stats->transfer_cache_bytes += cs.transfer_objs * cs.obj_size;
+        stats->central_cache_bytes += cs.central_objs * cs.obj_size;
+        small_span_bytes += cs.span_bytes;
+        small_in_use_bytes += cs.in_use_objs * cs.obj_size;
+    }
+    size_t free_pages = 0;
+    size_t returned_pages = 0;
+    size_t in_use_pages = 0;
+    size_t sampled_pages = 0;
+    page_cache::get_instance()->get_stats(free_pages, returned_pages, in_use_pages, sampled_pages);
+    stats->page_heap_free_bytes = free_pages << PAGE_SHIFT;
+    stats->page_heap_returned_bytes = returned_pages << PAGE_SHIFT;
+    // pc分出去的页，除了给cc切小对象的，就是大内存
+    stats->large_in_use_bytes = __sub_or_zero(in_use_pages << PAGE_SHIFT, small_span_bytes);
+    stats->sampled_in_use_bytes = sampled_pages << PAGE_SHIFT;
+    stats->in_use_bytes = small_in_use_bytes + stats->large_in_use_bytes + stats->sampled_in_use_bytes;
+    stats->system_bytes = system_stats::get_instance()->system_bytes();
+    stats->metadata_bytes = system_stats::get_instance()->metadata_bytes();
+    stats->metadata_unused_bytes = metadata_arena::get_instance()->unused_bytes();
+}
+
+// 往buf后面接着写，写不下也要把需要的长度算上
+static void __append(char* buf, size_t len, size_t& pos, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(pos < len ? buf + pos : nullptr, pos < len ? len - pos : 0, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        pos += n;
+}
+
+static inline double __mib(size_t bytes) {
+    return bytes / 1048576.0;
+}
+
+size_t tcmalloc_print_stats(char* buf, size_t len) {
+    tc_stats stats;
+    tcmalloc_get_stats(&stats);
+    size_t pos = 0;
+    if (len > 0)
+        buf[0] = '\0';
+    const char* line = "------------------------------------------------\n";
+    __append(buf, len, pos, "%s", line);
+    __append(buf, len, pos, "MALLOC:   %12zu (%10.1f MiB) Bytes in use by application\n", stats.in_use_bytes, __mib(stats.in_use_bytes));
+    __append(buf, len, pos, "MALLOC: + %12zu (%10.1f MiB) Bytes in page heap freelist\n", stats.page_heap_free_bytes, __mib(stats.page_heap_free_bytes));
+    __append(buf, len, pos, "MALLOC: + %12zu (%10.1f MiB) Bytes in central cache freelist\n", stats.central_cache_bytes, __mib(stats.central_cache_bytes));
+    __append(buf, len, pos, "MALLOC: + %12zu (%10.1f MiB) Bytes in transfer cache freelist\n", stats.transfer_cache_bytes, __mib(stats.transfer_cache_bytes));
+    __append(buf, len, pos, "MALLOC: + %12zu (%10.1f MiB) Bytes in thread cache freelists\n", stats.thread_cache_bytes, __mib(stats.thread_cache_bytes));
+    __append(buf, len, pos, "MALLOC: + %12zu (%10.1f MiB) Bytes in cpu cache freelists\n", stats.cpu_cache_bytes, __mib(stats.cpu_cache_bytes));
+    __append(buf, len, pos, "MALLOC: + %12zu (%10.1f MiB) Bytes in malloc metadata\n", stats.metadata_bytes, __mib(stats.metadata_bytes));
+    __append(buf, len, pos, "%s", line);
+    __append(buf, len, pos, "MALLOC:   %12zu (%10.1f MiB) Virtual address space obtained from the OS\n", stats.system_bytes, __mib(stats.system_bytes));
+    __append(buf, len, pos, "MALLOC:   %12zu (%10.1f MiB) Bytes released to the OS (aka unmapped)\n", stats.page_heap_returned_bytes, __mib(stats.page_heap_returned_bytes));
+    __append(buf, len, pos, "MALLOC:   %12zu (%10.1f MiB) Bytes in large objects\n", stats.large_in_use_bytes, __mib(stats.large_in_use_bytes));
+    __append(buf, len, pos, "MALLOC:   %12zu (%10.1f MiB) Bytes in sampled objects\n", stats.sampled_in_use_bytes, __mib(stats.sampled_in_use_bytes));
+    __append(buf, len, pos, "MALLOC:   %12zu (%10.1f MiB) Bytes of metadata not yet carved\n", stats.metadata_unused_bytes, __mib(stats.metadata_unused_bytes));
+    __append(buf, len, pos, "%s", line);
+    __append(buf, len, pos, "%5s %8s %12s %10s %10s %10s %10s %10s %12s\n",
+        "class", "size", "span_bytes", "in_use", "central", "transfer", "thread", "cpu", "frag_bytes");
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        const tc_class_stats& cs = stats.classes[i];
+        if (cs.span_bytes == 0)
+            continue; // 没用过的桶不打印
+        __append(buf, len, pos, "%5zu %8zu %12zu %10zu %10zu %10zu %10zu %10zu %12zu\n",
+            i, cs.obj_size, cs.span_bytes, cs.in_use_objs, cs.central_objs, cs.transfer_objs,
+            cs.thread_objs, cs.cpu_objs, cs.fragmentation_bytes);
+    }
+    return pos;
+}
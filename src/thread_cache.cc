@@ -3,12 +3,91 @@
 #include "../include/thread_cache.hpp"
 #include "../include/central_cache.hpp"
 #include "../include/log.hpp"
+#include "../include/page_cache.hpp"
+
+std::mutex thread_cache::__s_budget_mtx;
+thread_cache* thread_cache::__s_head = nullptr;
+thread_cache* thread_cache::__s_next_steal = nullptr;
+long long thread_cache::__s_unclaimed = OVERALL_THREAD_CACHE_SIZE;
+size_t thread_cache::__s_overall_size = OVERALL_THREAD_CACHE_SIZE;
+std::atomic<bool> thread_cache::__s_owner_used[MAX_REMOTE_OWNERS + 1];
+remote_queue thread_cache::__s_remote[MAX_REMOTE_OWNERS + 1];
+
+__thread thread_cache* p_tls_thread_cache = nullptr;
+
+thread_cache::thread_cache()
+    : __max_size(0) {
+    std::lock_guard<std::mutex> lock(__s_budget_mtx);
+    // 挂到链表上
+    __next = __s_head;
+    if (__s_head)
+        __s_head->__prev = this;
+    __s_head = this;
+    __increase_cache_limit_locked();
+    if (__max_size == 0) {
+        // 全局的额度已经分完了，也偷不到，那就先给最小额度(__s_unclaimed会变成负数)
+        __max_size = MIN_THREAD_CACHE_SIZE;
+        __s_unclaimed -= MIN_THREAD_CACHE_SIZE;
+    }
+    // 找一个空着的远程队列编号，队列里可能还有上一个主人退出之后别人压进来的对象，接着用就行
+    for (size_t id = 1; id <= MAX_REMOTE_OWNERS; id++) {
+        if (!__s_owner_used[id].load(std::memory_order_relaxed)) {
+            __s_owner_used[id].store(true, std::memory_order_relaxed);
+            __owner_id = id;
+            break;
+        }
+    }
+}
+
+thread_cache::~thread_cache() {
+    std::lock_guard<std::mutex> lock(__s_budget_mtx);
+    // 额度还回去，从链表上拿下来
+    __s_unclaimed += __max_size; // 远程队列编号在release_all里面已经还掉了
+    if (__s_next_steal == this)
+        __s_next_steal = __next;
+    if (__prev)
+        __prev->__next = __next;
+    else
+        __s_head = __next;
+    if (__next)
+        __next->__prev = __prev;
+}
+
+void thread_cache::__increase_cache_limit_locked() {
+    if (__s_unclaimed > 0) {
+        // 全局还有额度，直接拿
+        __s_unclaimed -= STEAL_AMOUNT;
+        __max_size += STEAL_AMOUNT;
+        return;
+    }
+    // 全局没有了，轮流从别的线程那里偷，最多试10个
+    for (int i = 0; i < 10; ++i, __s_next_steal = __s_next_steal->__next) {
+        if (__s_next_steal == nullptr)
+            __s_next_steal = __s_head;
+        if (__s_next_steal == this || __s_next_steal->__max_size <= MIN_THREAD_CACHE_SIZE)
+            continue;
+        // 被偷的线程下一次释放的时候发现超额了，会自己scavenge
+        __s_next_steal->__max_size -= STEAL_AMOUNT;
+        __max_size += STEAL_AMOUNT;
+        __s_next_steal = __s_next_steal->__next;
+        return;
+    }
+}
+
+void thread_cache::set_overall_cache_size(size_t bytes) {
+    if (bytes < MIN_THREAD_CACHE_SIZE)
+        bytes = MIN_THREAD_CACHE_SIZE;
+    std::lock_guard<std::mutex> lock(__s_budget_mtx);
+    __s_unclaimed += (long long)bytes - (long long)__s_overall_size;
+    __s_overall_size = bytes;
+}
 
 void* thread_cache::allocate(size_t size) {
     assert(size <= MAX_BYTES);
     size_t align_size = size_class::round_up(size);
     size_t bucket_index = size_class::bucket_index(size);
     if (!__free_lists[bucket_index].empty()) {
+        __size -= align_size;
         return __free_lists[bucket_index].pop();
     } else {
         // 这个桶下面没有内存了！找centralCache找
@@ -19,22 +98,110 @@ void* thread_cache::allocate(size_t size) {
     }
 }
 
+void thread_cache::allocate_batch(size_t size, size_t n, void** out) {
+    assert(size <= MAX_BYTES);
+    size_t align_size = size_class::round_up(size);
+    size_t index = size_class::bucket_index(size);
+    free_list& list = __free_lists[index];
+    // 先把自由链表上有的拿走
+    size_t got = list.pop_batch(out, n);
+    __size -= got * align_size;
+    if (got == n)
+        return;
+    if (n - got <= list.max_size()) {
+        // 剩下的不多，照常一次补一批(慢开始)
+        while (got < n)
+            out[got++] = allocate(size);
+        return;
+    }
+    // 剩下的比链表能装的还多，直接从cc按批拿，拿到的直接给调用者
+    size_t batch_num = size_class::num_move_size(align_size);
+    // 调用者一次就要这么多，链表上限直接涨到能放下一整批(不超过批量上限)，这一批还回来的时候就能留在本地
+    list.max_size() = std::max(list.max_size(), std::min(n + 1, batch_num));
+    while (got < n) {
+        void* start = nullptr;
+        void* end = nullptr;
+        size_t actual_n = __pop_remote(index, start, end);
+        if (actual_n > 0) {
+            // 别的线程还回来的，先挂到自由链表上再拿，用不完的留着
+            list.push(start, end, actual_n);
+            size_t k = list.pop_batch(out + got, n - got);
+            __size += (actual_n - k) * align_size;
+            got += k;
+            continue;
+        }
+        central_cache::get_instance()->fetch_range_obj(start, end, std::min(batch_num, n - got), align_size, __owner_id);
+        for (void* obj = start; obj != nullptr; obj = free_list::__next_obj(obj))
+            out[got++] = obj;
+    }
+}
+
+void thread_cache::deallocate_batch(void** ptrs, size_t n, size_t size) {
+    assert(size <= MAX_BYTES);
+    if (n == 0)
+        return;
+    size_t index = size_class::bucket_index(size);
+    size_t bucket_size = size_class::bucket_size(index);
+    free_list& list = __free_lists[index];
+    if (n > list.max_size()) {
+        // 比链表能装的还多，直接按批还(先试主人的远程队列，再给cc)
+        size_t batch_num = size_class::num_move_size(bucket_size);
+        for (size_t i = 0; i < n; i += batch_num) {
+            size_t m = std::min(batch_num, n - i);
+            for (size_t j = i; j < i + m - 1; j++)
+                free_list::__next_obj(ptrs[j]) = ptrs[j + 1];
+            free_list::__next_obj(ptrs[i + m - 1]) = nullptr;
+            if (!__push_remote(ptrs[i], ptrs[i + m - 1], m, bucket_size))
+                central_cache::get_instance()->release_range(ptrs[i], ptrs[i + m - 1], m, bucket_size);
+        }
+        return;
+    }
+    // 串成一段，一次挂到自由链表上
+    for (size_t j = 0; j < n - 1; j++)
+        free_list::__next_obj(ptrs[j]) = ptrs[j + 1];
+    list.push(ptrs[0], ptrs[n - 1], n);
+    __size += n * bucket_size;
+    // 现在一次只还一批，一大批放进来之后可能要还好几次
+    while (list.size() >= list.max_size())
+        list_too_long(list, bucket_size);
+    __count_frees(n);
+    if (__size > __max_size)
+        scavenge();
+}
+
 void* thread_cache::fetch_from_central_cache(size_t index, size_t size) {
+    void* start = nullptr;
+    void* end = nullptr;
+    // 先看看别的线程有没有把对象还到自己的远程队列里，有的话整个拿过来，不用找centralCache
+    size_t actual_n = __pop_remote(index, start, end);
+    if (actual_n > 0) {
+        if (actual_n > 1) {
+            __free_lists[index].push(free_list::__next_obj(start), end, actual_n - 1);
+            __size += (actual_n - 1) * size;
+        }
+        return start;
+    }
     // 慢开始反馈调节算法
-    size_t batch_num = std::min(__free_lists[index].max_size(), size_class::num_move_size(size));
-    if (__free_lists[index].max_size() == batch_num)
-        __free_lists[index].max_size() += 1; // 最多增长到512了
+    free_list& list = __free_lists[index];
+    size_t batch_size = size_class::num_move_size(size);
+    size_t batch_num = std::min(list.max_size(), batch_size);
+    if (list.max_size() < batch_size) {
+        list.max_size() += 1;
+    } else {
+        // 已经涨到一批了，再往上一次涨一批，上限保持是批大小的整数倍，还回去的时候正好整批
+        size_t new_max = std::min(list.max_size() + batch_size, MAX_DYNAMIC_FREE_LIST_LENGTH);
+        new_max -= new_max % batch_size;
+        list.max_size() = std::max(new_max, batch_size);
+    }
     // 1. 最开始一次向centralCache要太多，因为太多了可能用不完
     // 2. 如果你一直有这个桶size大小的内存，那么后面我可以给你越来越多，直到上限(size_class::num_move_size(size))
     //      这个上限是根据这个桶的内存块大小size来决定的
     // 3. size越大，一次向centralcache要的就越小，如果size越小，相反。
     // 开始获取内存了
-    void* start = nullptr;
-    void* end = nullptr;
 #ifdef PROJECT_DEBUG
     LOG(DEBUG) << "thread_cache::fetch_from_central_cache call  central_cache::get_instance()->fetch_range_obj()" << std::endl;
 #endif
-    size_t actual_n = central_cache::get_instance()->fetch_range_obj(start, end, batch_num, size);
+    actual_n = central_cache::get_instance()->fetch_range_obj(start, end, batch_num, size, __owner_id);
 #ifdef PROJECT_DEBUG
     LOG(DEBUG) << "actual_n"
                << ":" << actual_n << std::endl;
@@ -44,7 +211,8 @@ void* thread_cache::fetch_from_central_cache(size_t index, size_t size) {
         assert(start == end);
         return start;
     } else {
-        __free_lists[index].push(free_list::__next_obj(start), end, actual_n - 1);
+        list.push(free_list::__next_obj(start), end, actual_n - 1);
+        __size += (actual_n - 1) * size;
         return start;
     }
 
@@ -56,22 +224,184 @@ void thread_cache::deallocate(void* ptr, size_t size) {
     assert(size <= MAX_BYTES);
     size_t index = size_class::bucket_index(size);
     __free_lists[index].push(ptr);
+    __size += size_class::bucket_size(index);
     // 当链表长度大于一次批量申请的内存的时候，就开始还一段list给cc
     if (__free_lists[index].size() >= __free_lists[index].max_size()) {
 #ifdef PROJECT_DEBUG
         LOG(DEBUG) << __free_lists[index].size() << ":" << __free_lists[index].max_size() << std::endl;
         LOG(DEBUG) << "call list_too_long" << std::endl;
 #endif
-        list_too_long(__free_lists[index], size);
+        list_too_long(__free_lists[index], size_class::bucket_size(index));
     }
+    __count_frees(1);
+    // 整个threadCache缓存的太多了
+    if (__size > __max_size)
+        scavenge();
 }
 
 void thread_cache::list_too_long(free_list& list, size_t size) {
     void* start = nullptr;
     void* end = nullptr;
-    list.pop(start, end, list.max_size());
+    // 只还一批，剩下的留着: 还到上限以下一批的位置，下次涨到上限之前能接住一整批的申请，不会来回抖
+    size_t batch_size = size_class::num_move_size(size);
+    size_t n = std::min(batch_size, list.size());
+    list.pop(start, end, n);
+    __size -= n * size;
+    if (list.max_size() < batch_size) {
+        // 还没涨到一批，接着慢开始
+        list.max_size() += 1;
+    } else if (list.max_size() > batch_size) {
+        // 上限涨过头了，总是被释放顶满，降一批
+        if (++list.overages() > MAX_OVERAGES) {
+            list.max_size() -= batch_size;
+            list.overages() = 0;
+        }
+    }
     #ifdef PROJECT_DEBUG
-    LOG(DEBUG) << "list pop success -> call release_list_to_spans()" << std::endl;
+    LOG(DEBUG) << "list pop success -> call release_range()" << std::endl;
     #endif
-    central_cache::get_instance()->release_list_to_spans(start, size);
-}
\ No newline at end of file
+    // 释放的比申请的多，多半是别的线程申请的对象(生产者/消费者)，整批还给它，不用去拿cc的锁
+    if (__push_remote(start, end, n, size))
+        return;
+    central_cache::get_instance()->release_range(start, end, n, size);
+}
+
+bool thread_cache::__push_remote(void* start, void* end, size_t n, size_t size) {
+    // 只看第一个对象的span，一批里面有别人的对象也没关系，任何threadCache都能用同一个桶的对象
+    span* s = page_cache::get_instance()->map_obj_to_span(start);
+    size_t owner = __atomic_load_n(&s->__owner, __ATOMIC_RELAXED);
+    if (owner == 0 || owner == __owner_id)
+        return false;
+    if (!__s_owner_used[owner].load(std::memory_order_relaxed))
+        return false; // 主人已经退出了，没人来拿，直接还给cc
+    remote_queue& q = __s_remote[owner];
+    size_t index = size_class::bucket_index(size);
+    size_t max_objs = std::max(size_class::num_move_size(size), REMOTE_QUEUE_BYTES / size_class::bucket_size(index));
+    // 先占上个数再压，拿走的人看到对象的时候计数一定已经加上了
+    if (q.objs[index].fetch_add(n, std::memory_order_relaxed) + n > max_objs) {
+        q.objs[index].fetch_sub(n, std::memory_order_relaxed); // 主人很久没来拿了
+        return false;
+    }
+    void* head = q.heads[index].load(std::memory_order_relaxed);
+    do {
+        free_list::__next_obj(end) = head;
+    } while (!q.heads[index].compare_exchange_weak(head, start, std::memory_order_seq_cst, std::memory_order_relaxed));
+    // 主人可能刚好在退出: 它先清标记再看队列，我们先压再看标记，都是seq_cst，两边至少有一边能看到对方
+    // 看到主人已经不在了，刚压进去的(连同别人压的)就由我们拿出来还给cc
+    if (!__s_owner_used[owner].load(std::memory_order_seq_cst)) {
+        size_t m = __take_remote(owner, index, start, end);
+        if (m > 0)
+            central_cache::get_instance()->release_range(start, end, m, size_class::bucket_size(index));
+    }
+    return true;
+}
+
+size_t thread_cache::__pop_remote(size_t index, void*& start, void*& end) {
+    if (__owner_id == 0)
+        return 0;
+    return __take_remote(__owner_id, index, start, end);
+}
+
+size_t thread_cache::__take_remote(size_t owner, size_t index, void*& start, void*& end) {
+    remote_queue& q = __s_remote[owner];
+    if (q.heads[index].load(std::memory_order_seq_cst) == nullptr)
+        return 0; // 大部分时候是空的，先读一下，不用每次都exchange(seq_cst是为了和__push_remote里的标记配对)
+    start = q.heads[index].exchange(nullptr, std::memory_order_acquire);
+    if (start == nullptr)
+        return 0;
+    size_t n = 1;
+    end = start;
+    while (free_list::__next_obj(end) != nullptr) {
+        end = free_list::__next_obj(end);
+        ++n;
+    }
+    q.objs[index].fetch_sub(n, std::memory_order_relaxed);
+    return n;
+}
+void thread_cache::release_all() {
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        free_list& list = __free_lists[i];
+        if (list.empty())
+            continue;
+        void* start = nullptr;
+        void* end = nullptr;
+        size_t n = list.size();
+        list.pop(start, end, n);
+        central_cache::get_instance()->release_range(start, end, n, size_class::bucket_size(i));
+    }
+    __size = 0;
+    if (__owner_id == 0)
+        return;
+    // 先说自己不在了，再把别的线程压到远程队列里还没拿的还掉，之后再压进来的由压的线程自己还(见__push_remote)
+    __s_owner_used[__owner_id].store(false, std::memory_order_seq_cst);
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        void* start = nullptr;
+        void* end = nullptr;
+        size_t n = __pop_remote(i, start, end);
+        if (n > 0)
+            central_cache::get_instance()->release_range(start, end, n, size_class::bucket_size(i));
+    }
+}
+
+void thread_cache::__release_idle_objects() {
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        free_list& list = __free_lists[i];
+        size_t low = list.low_water();
+        if (low > 0) {
+            // 这么多对象从上次检查到现在一直没用到，还一半回去
+            size_t drop = low > 1 ? low / 2 : 1;
+            size_t size = size_class::bucket_size(i);
+            void* start = nullptr;
+            void* end = nullptr;
+            list.pop(start, end, drop);
+            __size -= drop * size;
+            central_cache::get_instance()->release_range(start, end, drop, size);
+            // 用不了这么多，上限也降一批
+            size_t batch_size = size_class::num_move_size(size);
+            if (list.max_size() > batch_size)
+                list.max_size() = std::max(list.max_size() - batch_size, batch_size);
+        }
+        list.clear_low_water();
+    }
+}
+void thread_cache::scavenge() {
+    // 先还闲着的，忙的链表不动
+    __release_idle_objects();
+    // 还不够，一个桶一个桶地还一半，降到额度以下就停
+    for (size_t i = 0; i < BUCKETS_NUM && __size > __max_size; i++) {
+        free_list& list = __free_lists[i];
+        if (list.empty())
+            continue;
+        void* start = nullptr;
+        void* end = nullptr;
+        size_t n = (list.size() + 1) / 2; // 还一半，至少还一个
+        size_t size = size_class::bucket_size(i);
+        list.pop(start, end, n);
+        __size -= n * size;
+        central_cache::get_instance()->release_range(start, end, n, size);
+    }
+    // 这个线程确实需要更多的缓存，去拿一点额度
+    std::lock_guard<std::mutex> lock(__s_budget_mtx);
+    __increase_cache_limit_locked();
+}
+
+size_t thread_cache::get_stats(size_t* objs) {
+    std::lock_guard<std::mutex> lock(__s_budget_mtx); // 拿着锁，链表上的threadCache不会被释放
+    size_t bytes = 0;
+    for (thread_cache* tc = __s_head; tc != nullptr; tc = tc->__next) {
+        // 别的线程的__size是普通变量，不能读，字节数用链表长度(原子变量)算
+        for (size_t i = 0; i < BUCKETS_NUM; i++) {
+            size_t n = tc->__free_lists[i].size();
+            objs[i] += n;
+            bytes += n * size_class::bucket_size(i);
+        }
+    }
+    for (size_t id = 1; id <= MAX_REMOTE_OWNERS; id++) {
+        for (size_t i = 0; i < BUCKETS_NUM; i++) {
+            size_t n = __s_remote[id].objs[i].load(std::memory_order_relaxed);
+            objs[i] += n;
+            bytes += n * size_class::bucket_size(i);
+        }
+    }
+    return bytes;
+}
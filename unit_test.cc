@@ -1,11 +1,16 @@
 
 
+#include "./include/central_cache.hpp"
 #include "./include/tcmalloc.hpp"
 #include <functional>
 #include <iostream>
 #include <map>
 #include <random>
+#include <set>
+#include <string.h>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 void alloc1() {
     for (size_t i = 0; i < 5; i++) {
@@ -82,15 +87,760 @@ void big_alloc() {
     t1.join();
 }
 
+// 线程不停地创建退出，退出时threadCache里的内存要还回去，threadCache对象也要复用
+void thread_exit_test() {
+    std::set<thread_cache*> caches; // 所有线程用过的threadCache
+    size_t index = size_class::bucket_index(64);
+    tc_stats before;
+    tcmalloc_get_stats(&before);
+    for (size_t round = 0; round < 100; round++) {
+        std::vector<void*> kept; // 每个span留一个对象不还，span就一直在cc里，可以看它的计数
+        std::thread t([&]() {
+            std::vector<void*> v;
+            for (size_t i = 0; i < 1000; i++)
+                v.push_back(tcmalloc(64));
+            caches.insert(p_tls_thread_cache);
+            std::set<span*> spans;
+            for (auto e : v) {
+                if (spans.insert(page_cache::get_instance()->map_obj_to_span(e)).second)
+                    kept.push_back(e);
+                else
+                    tcfree(e);
+            }
+        });
+        t.join();
+        // 线程退出的时候threadCache里剩下的对象都还给了cc，每个span只剩留下的那一个还在用
+        // 打开每CPU缓存的时候对象留在CPU的缓存里，不跟着线程走
+        if (!cpu_cache::get_instance()->active()) {
+            central_cache::get_instance()->drain_transfer_caches(); // 还回来的整批先放在transfer cache里
+            for (auto e : kept)
+                assert(page_cache::get_instance()->map_obj_to_span(e)->__use_count == 1);
+        }
+        std::thread([&]() {
+            for (auto e : kept)
+                tcfree(e);
+        }).join();
+    }
+    // threadCache对象还回了tc_pool，后面的线程接着用同一个
+    assert(caches.size() == 1);
+    // 线程都退出了，它们threadCache里的对象全都还回去了
+    tc_stats after;
+    tcmalloc_get_stats(&after);
+    assert(after.classes[index].thread_objs == before.classes[index].thread_objs);
+    assert(after.classes[index].in_use_objs == before.classes[index].in_use_objs);
+    assert(after.thread_cache_bytes == before.thread_cache_bytes);
+    std::cout << "thread exit test run successful" << std::endl;
+}
+
+void object_pool_reuse_test() {
+    // 还回去的对象再拿出来要重新构造，不能带着链表指针和上次的数据
+    struct obj {
+        void* p = nullptr;
+        size_t n = 42;
+    };
+    object_pool<obj> pool;
+    obj* a = pool.new_();
+    obj* b = pool.new_();
+    a->n = b->n = 0;
+    pool.delete_(a);
+    pool.delete_(b);
+    for (int i = 0; i < 2; i++) {
+        obj* c = pool.new_();
+        assert(c->p == nullptr && c->n == 42);
+    }
+    std::cout << "object pool reuse test run successful" << std::endl;
+}
+void thread_budget_test() {
+    // 直接造两个threadCache当成两个线程用，总额度只够分三份最小额度
+    thread_cache::set_overall_cache_size(3 * MIN_THREAD_CACHE_SIZE);
+    // 每轮每个桶申请几个再全部释放，所有桶的链表加起来能缓存的比总额度多得多
+    auto churn = [](thread_cache* tc) {
+        std::vector<std::pair<void*, size_t>> v;
+        for (size_t round = 0; round < 64; round++) {
+            for (size_t size = 16 * 1024; size <= MAX_BYTES; size += 8 * 1024)
+                for (size_t i = 0; i < 4; i++)
+                    v.push_back({ tc->allocate(size), size });
+            for (auto e : v)
+                tc->deallocate(e.first, e.second);
+            v.clear();
+            assert(tc->size() <= tc->max_size()); // 超了额度当场就还回去
+        }
+    };
+    thread_cache* a = new thread_cache;
+    churn(a);
+    // a把全局剩下的额度都拿走了，但是不会超过总额度
+    size_t a_max = a->max_size();
+    assert(a_max > 2 * MIN_THREAD_CACHE_SIZE);
+    assert(a_max <= 3 * MIN_THREAD_CACHE_SIZE + STEAL_AMOUNT);
+    thread_cache* b = new thread_cache;
+    churn(b);
+    // 全局没有额度了，b只能从a那里偷，偷到a只剩最小额度为止
+    assert(a->max_size() == MIN_THREAD_CACHE_SIZE);
+    assert(b->max_size() > MIN_THREAD_CACHE_SIZE);
+    assert(a->max_size() + b->max_size() <= 3 * MIN_THREAD_CACHE_SIZE + STEAL_AMOUNT);
+    a->release_all();
+    b->release_all();
+    delete a;
+    delete b;
+    thread_cache::set_overall_cache_size(OVERALL_THREAD_CACHE_SIZE);
+    std::cout << "thread budget test run successful" << std::endl;
+}
+void page_shard_test() {
+    page_cache* pc = page_cache::get_instance();
+    // 小对象: 每个桶的span固定从index % PAGE_SHARDS这个分片里来
+    for (size_t size = 8; size <= MAX_BYTES; size *= 2) {
+        void* ptr = tcmalloc(size);
+        assert(pc->heap_of(pc->map_obj_to_span(ptr)) == pc->heap_for_class(size_class::bucket_index(size)));
+        tcfree(ptr);
+    }
+    // 大对象: 从申请的线程的分片里来，别的线程释放的时候还给原来的分片
+    size_t size = (size_t)64 << PAGE_SHIFT;
+    void* ptr = nullptr;
+    page_heap* owner = nullptr;
+    std::thread a([&]() {
+        ptr = tcmalloc(size);
+        owner = pc->heap_for_thread();
+        assert(pc->heap_of(pc->map_obj_to_span(ptr)) == owner);
+    });
+    a.join();
+    std::atomic<bool> freed(false);
+    owner->__page_mtx.lock(); // 拿住原来分片的锁，别的线程释放的时候只能等着
+    std::thread b([&]() {
+        assert(pc->heap_for_thread() != owner);
+        void* other = tcmalloc(size); // 自己的分片有自己的锁，不受影响
+        tcfree(other);
+        tcfree(ptr);
+        freed = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    assert(!freed);
+    owner->__page_mtx.unlock();
+    b.join();
+    assert(freed);
+    std::cout << "page shard test run successful" << std::endl;
+}
+void release_memory_test() {
+    // 申请再释放一批页，然后全部还给操作系统，还掉的页要能再拿回来用
+    std::vector<void*> v;
+    for (size_t i = 0; i < 64; i++)
+        v.push_back(tcmalloc(64 * 1024));
+    for (auto e : v)
+        tcfree(e);
+    size_t released = page_cache::get_instance()->release_memory((size_t)1 << 30);
+    std::cout << "released " << released << " bytes" << std::endl;
+    v.clear();
+    for (size_t i = 0; i < 64; i++) {
+        char* ptr = (char*)tcmalloc(64 * 1024);
+        memset(ptr, 0x5a, 64 * 1024);
+        v.push_back(ptr);
+    }
+    for (auto e : v)
+        tcfree(e);
+    std::cout << "release memory test run successful" << std::endl;
+}
+
+void returned_merge_test() {
+    // 刚释放的常驻span挨着已经还给系统的span，合并到一起，还掉的页数跟着带过来
+    page_cache* pc = page_cache::get_instance();
+    page_heap* heap = pc->heap_for_thread();
+    size_t rate = pc->release_rate();
+    pc->set_release_rate(0); // 释放路径上不要顺手还页
+    std::lock_guard<std::mutex> lock(heap->__page_mtx);
+    // 一直切8页的span，直到拿到三个挨着并且在同一个大页里的，a前面那个还在用，a只能和b合并
+    std::vector<span*> v;
+    span* a = nullptr;
+    span* b = nullptr;
+    auto next_to = [](span* x, span* y) {
+        return x->__page_id + x->__n == y->__page_id
+            && x->__page_id / HUGEPAGE_PAGES == y->__page_id / HUGEPAGE_PAGES;
+    };
+    while (b == nullptr) {
+        span* s = heap->new_span(8);
+        s->__is_use = true;
+        if (v.size() >= 2 && next_to(v[v.size() - 2], v.back()) && next_to(v.back(), s)) {
+            a = v.back();
+            b = s;
+            v.pop_back();
+        } else {
+            v.push_back(s);
+        }
+    }
+    PAGE_ID a_id = a->__page_id;
+    heap->release_span_to_page(a);
+    heap->release_at_least_n_pages((size_t)1 << 30); // a还给系统
+    assert(heap->free_pages() == 0);
+    size_t returned = heap->returned_pages();
+    heap->release_span_to_page(b);
+    assert(b->__page_id == a_id); // 和前面还掉的a合并了
+    assert(b->__returned_n == b->__n - 8); // 只有b的8页还在内存里
+    assert(heap->free_pages() == 8);
+    assert(heap->returned_pages() == returned);
+    for (auto e : v)
+        heap->release_span_to_page(e);
+    pc->set_release_rate(rate);
+    std::cout << "returned merge test run successful" << std::endl;
+}
+
+void hugepage_release_test() {
+    // 大页里还有span在用的时候不能还，整个大页都空闲了才一次还掉
+    page_cache* pc = page_cache::get_instance();
+    page_heap* heap = pc->heap_for_thread();
+    size_t rate = pc->release_rate();
+    pc->set_release_rate(0);
+    std::lock_guard<std::mutex> lock(heap->__page_mtx);
+    // 一直要128页的span，直到拿到同一个大页里的所有span
+    const size_t per_huge = HUGEPAGE_PAGES / (PAGES_NUM - 1);
+    std::map<PAGE_ID, std::vector<span*>> by_huge;
+    std::vector<span*> mine;
+    while (mine.empty()) {
+        span* s = heap->new_span(PAGES_NUM - 1);
+        s->__is_use = true;
+        std::vector<span*>& v = by_huge[s->__page_id / HUGEPAGE_PAGES];
+        v.push_back(s);
+        if (v.size() == per_huge)
+            mine = v;
+    }
+    // 还一个回去，大页里其它的还在用，只还整个大页的时候不能动它
+    span* first = mine[0];
+    heap->release_span_to_page(first);
+    while (heap->release_at_least_n_pages(HUGEPAGE_PAGES, false) > 0) { }
+    assert(first->__returned_n == 0);
+    // 全部还回去，整个大页就能还掉了
+    for (size_t i = 1; i < mine.size(); i++)
+        heap->release_span_to_page(mine[i]);
+    while (heap->release_at_least_n_pages(HUGEPAGE_PAGES, false) > 0) { }
+    for (auto s : mine)
+        assert(s->__returned_n == s->__n);
+    for (auto& e : by_huge) {
+        for (auto s : e.second) {
+            if (s->__is_use)
+                heap->release_span_to_page(s);
+        }
+    }
+    pc->set_release_rate(rate);
+    std::cout << "hugepage release test run successful" << std::endl;
+}
+
+void size_class_table_test() {
+    // 编译期生成的表: 从8字节开始严格递增，最后一个是MAX_BYTES，对象都是8字节对齐的
+    assert(size_class::bucket_size(0) == 8);
+    assert(size_class::bucket_size(BUCKETS_NUM - 1) == MAX_BYTES);
+    for (size_t i = 1; i < BUCKETS_NUM; i++) {
+        assert(size_class::bucket_size(i) > size_class::bucket_size(i - 1));
+        assert(size_class::bucket_size(i) % 8 == 0);
+    }
+    // 每个大小查一次表找到的都是装得下它的最小的size class，64字节以上浪费的不超过1/8
+    for (size_t size = 1; size <= MAX_BYTES; size++) {
+        size_t index = size_class::bucket_index(size);
+        size_t class_size = size_class::bucket_size(index);
+        assert(class_size >= size);
+        assert(index == 0 || size_class::bucket_size(index - 1) < size);
+        assert(size_class::round_up(size) == class_size);
+        if (size >= 64)
+            assert((class_size - size) * 8 <= class_size);
+    }
+    // 一次从pc拿的页至少装得下一整批对象
+    for (size_t i = 0; i < BUCKETS_NUM; i++) {
+        size_t size = size_class::bucket_size(i);
+        assert((size_class::num_move_page(size) << PAGE_SHIFT) / size >= size_class::num_move_size(size));
+    }
+    std::cout << "size class table test run successful" << std::endl;
+}
+void sized_free_test() {
+    // 各种大小都用tcfree_sized还回去，debug模式下会检查大小对不对
+    std::vector<std::pair<void*, size_t>> v;
+    for (size_t size = 1; size <= MAX_BYTES * 2; size += size / 8 + 1)
+        v.push_back({ tcmalloc(size), size });
+    for (auto& e : v)
+        tcfree_sized(e.first, e.second);
+    std::cout << "sized free test run successful" << std::endl;
+}
+
+void size_class_map_test() {
+    // 小对象所在的页都记了桶号，和按大小算出来的一样，大对象的页没有桶号
+    std::vector<void*> v;
+    for (size_t size = 1; size <= MAX_BYTES; size += size / 8 + 1) {
+        void* p = tcmalloc(size);
+        size_t index = size_class::bucket_index(size);
+        assert(page_cache::get_instance()->obj_size_class(p) == index + 1);
+        assert(tcmalloc_usable_size(p) == size_class::bucket_size(index));
+        v.push_back(p);
+    }
+    // 大对象的页以前可能切过小对象，还回pc的时候桶号要清掉
+    void* big = tcmalloc(MAX_BYTES + 1);
+    assert(page_cache::get_instance()->obj_size_class(big) == 0);
+    assert(tcmalloc_usable_size(big) >= MAX_BYTES + 1);
+    tcfree(big);
+    for (auto e : v)
+        tcfree(e);
+    // 直接从分片拿一个span，像cc一样标上桶号，还回pc之后桶号就没了
+    page_cache* pc = page_cache::get_instance();
+    page_heap* heap = pc->heap_for_thread();
+    {
+        std::lock_guard<std::mutex> lock(heap->__page_mtx);
+        span* s = heap->new_span(2);
+        pc->set_span_size_class(s, 5);
+        void* first = (void*)(s->__page_id << PAGE_SHIFT);
+        void* last = (void*)((s->__page_id + 1) << PAGE_SHIFT);
+        assert(pc->obj_size_class(first) == 6 && pc->obj_size_class(last) == 6);
+        heap->release_span_to_page(s);
+        assert(pc->obj_size_class(first) == 0 && pc->obj_size_class(last) == 0);
+    }
+    std::cout << "size class map test run successful" << std::endl;
+}
+
+void aligned_alloc_test() {
+    // 从一个cache line到4MB的对齐，大小从1字节到1MB
+    for (size_t align = 64; align <= ((size_t)4 << 20); align <<= 1) {
+        std::vector<void*> v;
+        for (size_t size = 1; size <= ((size_t)1 << 20); size = size * 4 + 3) {
+            void* ptr = tcmalloc_aligned(size, align);
+            assert(((uintptr_t)ptr & (align - 1)) == 0);
+            assert(tcmalloc_usable_size(ptr) >= size);
+            memset(ptr, 0x5a, size);
+            v.push_back(ptr);
+        }
+        for (auto e : v)
+            tcfree(e);
+    }
+    std::cout << "aligned alloc test run successful" << std::endl;
+}
+
+void stats_test() {
+    tc_stats before;
+    tcmalloc_get_stats(&before);
+    std::vector<void*> v;
+    for (size_t i = 0; i < 1000; i++)
+        v.push_back(tcmalloc(100));
+    void* big = tcmalloc(1 << 20);
+    tc_stats after;
+    tcmalloc_get_stats(&after);
+    size_t index = size_class::bucket_index(100);
+    assert(after.classes[index].in_use_objs >= before.classes[index].in_use_objs + 1000);
+    assert(after.large_in_use_bytes >= before.large_in_use_bytes + (1 << 20));
+    assert(after.system_bytes >= after.in_use_bytes);
+    for (auto e : v)
+        tcfree(e);
+    tcfree(big);
+    char buf[16 * 1024];
+    tcmalloc_print_stats(buf, sizeof(buf));
+    std::cout << buf;
+    std::cout << "stats test run successful" << std::endl;
+}
+
+void stats_concurrent_test() {
+    // 别的线程一直在申请释放的时候读统计，tsan下不能报数据竞争
+    std::atomic<bool> stop(false);
+    std::thread worker([&]() {
+        std::vector<void*> v;
+        while (!stop) {
+            for (size_t i = 0; i < 256; i++)
+                v.push_back(tcmalloc(16 + i * 8));
+            for (auto e : v)
+                tcfree(e);
+            v.clear();
+        }
+    });
+    for (size_t i = 0; i < 100; i++) {
+        tc_stats stats;
+        tcmalloc_get_stats(&stats);
+        assert(stats.system_bytes >= stats.thread_cache_bytes);
+    }
+    stop = true;
+    worker.join();
+    std::cout << "stats concurrent test run successful" << std::endl;
+}
+
+void remote_free_test() {
+    // 主线程申请，另一个从来没申请过的线程释放，释放的对象要能回到主线程再用
+    std::vector<void*> v;
+    for (size_t i = 0; i < 10000; i++)
+        v.push_back(tcmalloc(64));
+    std::set<void*> freed(v.begin(), v.end());
+    std::thread consumer([&]() {
+        for (auto e : v)
+            tcfree(e);
+    });
+    consumer.join();
+    size_t reused = 0;
+    for (size_t i = 0; i < v.size(); i++) {
+        v[i] = tcmalloc(64);
+        reused += freed.count(v[i]);
+    }
+    assert(reused > 0);
+    for (auto e : v)
+        tcfree(e);
+    std::cout << "remote free test run successful" << std::endl;
+}
+void dead_owner_test() {
+    // 申请的线程已经退出了，另一个线程再释放，对象不能卡在死掉的线程的远程队列里，要回到cc
+    if (cpu_cache::get_instance()->active()) {
+        std::cout << "dead owner test skipped (cpu cache active)" << std::endl;
+        return;
+    }
+    const size_t size = 96;
+    size_t index = size_class::bucket_index(size);
+    tc_stats before;
+    tcmalloc_get_stats(&before);
+    std::vector<void*> v;
+    std::atomic<bool> go(false);
+    // 释放的线程先起来(先拿到自己的远程队列编号)，不然它会接着用死掉的线程的编号
+    std::thread consumer([&]() {
+        tcfree(tcmalloc(8));
+        while (!go)
+            std::this_thread::yield();
+        for (auto e : v)
+            tcfree(e);
+    });
+    std::thread producer([&]() {
+        for (size_t i = 0; i < 10000; i++)
+            v.push_back(tcmalloc(size));
+    });
+    producer.join();
+    go = true;
+    consumer.join();
+    tc_stats after;
+    tcmalloc_get_stats(&after);
+    assert(after.classes[index].thread_objs <= before.classes[index].thread_objs);
+    assert(after.classes[index].in_use_objs <= before.classes[index].in_use_objs);
+    std::cout << "dead owner test run successful" << std::endl;
+}
+void batch_test() {
+    // 各种大小和个数，个数有比自由链表短的也有比它长很多的
+    size_t sizes[] = { 1, 64, 1000, 4096, 65536, MAX_BYTES + 1 };
+    size_t counts[] = { 0, 1, 7, 128, 3000 };
+    for (size_t size : sizes) {
+        for (size_t n : counts) {
+            std::vector<void*> v(n + 1);
+            tcmalloc_batch(size, n, v.data());
+            std::set<void*> seen;
+            for (size_t i = 0; i < n; i++) {
+                memset(v[i], (int)i, size);
+                seen.insert(v[i]);
+            }
+            assert(seen.size() == n);
+            // 一半一起还，一半一个一个还
+            tcfree_batch(v.data(), n / 2, size);
+            for (size_t i = n / 2; i < n; i++)
+                tcfree(v[i]);
+        }
+    }
+    std::cout << "batch test run successful" << std::endl;
+}
+void sample_test() {
+    // 平均每64KB采样一次，申请16MB的小对象，应该能采到一两百个
+    tc_stats before;
+    tcmalloc_get_stats(&before);
+    tcmalloc_set_sample_period(64 * 1024);
+    std::vector<std::pair<void*, size_t>> v;
+    size_t sampled = 0;
+    for (size_t i = 0; i < 4096; i++) {
+        size_t size = 4096 + i % 64;
+        void* ptr = tcmalloc(size);
+        memset(ptr, 0, size);
+        if (page_cache::is_sampled(ptr))
+            sampled++;
+        v.push_back({ ptr, size });
+    }
+    std::cout << "sampled " << sampled << " objects" << std::endl;
+#if defined(__linux__)
+    assert(sampled > 0);
+#endif
+    // 采样的小对象单独统计，不能算成大内存
+    tc_stats after;
+    tcmalloc_get_stats(&after);
+    assert(after.sampled_in_use_bytes >= before.sampled_in_use_bytes + sampled * 4096);
+    assert(after.large_in_use_bytes <= before.large_in_use_bytes);
+    assert(tcmalloc_dump_heap_profile("/tmp/tcmalloc_sample_test.heap"));
+    tcmalloc_set_sample_period(0);
+    // 一半按大小还，一半不按大小还，采样的对象两种释放都要认得
+    for (size_t i = 0; i < v.size(); i++) {
+        if (i % 2)
+            tcfree_sized(v[i].first, v[i].second);
+        else
+            tcfree(v[i].first);
+    }
+    std::cout << "sample test run successful" << std::endl;
+}
+void sample_large_test() {
+    // 每次都采样，大内存申请释放加起来是采样地址空间的两倍，还掉的页要能重复用，一直都能采到
+    const size_t size = (size_t)4 << 20;
+    const size_t rounds = 2 * SAMPLED_REGION_BYTES / size;
+    tcmalloc_set_sample_period(1);
+    size_t late = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        void* ptr = tcmalloc(size);
+        if (i >= rounds / 2 && page_cache::is_sampled(ptr))
+            late++;
+        tcfree(ptr);
+    }
+    tcmalloc_set_sample_period(0);
+    std::cout << "sampled " << late << " of the last " << rounds - rounds / 2 << " large objects" << std::endl;
+#if defined(__linux__)
+    assert(late == rounds - rounds / 2);
+#endif
+    std::cout << "sample large test run successful" << std::endl;
+}
+void adaptive_list_test() {
+    // 一个桶缓存了一堆对象之后再也不用了，一直释放别的大小，闲着的那些要慢慢还回去
+    // 每CPU缓存打开的时候不走threadCache
+    if (cpu_cache::get_instance()->active()) {
+        std::cout << "adaptive list test skipped (cpu cache active)" << std::endl;
+        return;
+    }
+    std::thread t([]() {
+        size_t index = size_class::bucket_index(64);
+        // 批量申请会把链表上限直接涨到一整批，一起还回来就都留在链表上(小对象，新线程的额度装得下)
+        const size_t n = size_class::num_move_size(64) - 12;
+        std::vector<void*> v(n);
+        tcfree(tcmalloc(8)); // 新线程的采样计数器是0，第一批会一个一个地申请，先申请一次
+        tcmalloc_batch(64, n, v.data());
+        tcfree_batch(v.data(), n, 64);
+        tc_stats before;
+        tcmalloc_get_stats(&before);
+        assert(before.classes[index].thread_objs >= n);
+        // 第一次检查只是记下low water，之后每检查一次还一半，检查5次之后剩1/16左右
+        for (size_t i = 0; i < 5 * IDLE_CHECK_FREES + 1; i++)
+            tcfree(tcmalloc(1000));
+        tc_stats after;
+        tcmalloc_get_stats(&after);
+        std::cout << "idle objects " << before.classes[index].thread_objs << " -> " << after.classes[index].thread_objs << std::endl;
+        assert(after.classes[index].thread_objs * 8 <= before.classes[index].thread_objs);
+    });
+    t.join();
+    std::cout << "adaptive list test run successful" << std::endl;
+}
+void large_cache_test() {
+    // 大内存释放之后留在大span缓存里，再申请差不多大的拿回同一块，不用再找系统要
+    size_t size = 4 * 1024 * 1024;
+    char* a = (char*)tcmalloc(size);
+    memset(a, 0x5a, size);
+    tcfree(a);
+    size_t system_before = system_stats::get_instance()->system_bytes();
+    char* b = (char*)tcmalloc(size - 100 * 1024); // 缓存里的比要的大，多出来的不超过1/8，也能用
+    assert(b == a);
+    memset(b, 0x5a, size - 100 * 1024);
+    assert(system_stats::get_instance()->system_bytes() == system_before);
+    tcfree(b);
+    // 小很多的从前面切一段，剩下的留在缓存里，还回来的时候再拼起来
+    char* c = (char*)tcmalloc(size / 2);
+    assert(c == a);
+    char* e = (char*)tcmalloc(size / 2);
+    assert(e == a + size / 2);
+    assert(system_stats::get_instance()->system_bytes() == system_before);
+    tcfree(c);
+    tcfree(e);
+    char* f = (char*)tcmalloc(size);
+    assert(f == a);
+    tcfree(f);
+    // 还内存的时候缓存里的先还
+    size_t released = page_cache::get_instance()->release_memory(size);
+    assert(released >= size);
+    char* d = (char*)tcmalloc(size);
+    memset(d, 0x5a, size);
+    tcfree(d);
+    std::cout << "large cache test run successful" << std::endl;
+}
+void large_reuse_test() {
+    // 放不进大span缓存的大内存反复申请释放，从系统要的内存和元数据(radix树的节点)都不能一直涨
+    const size_t sizes[] = { (size_t)32 << 20, (size_t)600 << 20 };
+    for (size_t base : sizes) {
+        for (size_t i = 0; i < 3; i++)
+            tcfree(tcmalloc(base + i * 8192));
+        size_t system_before = system_stats::get_instance()->system_bytes();
+        size_t metadata_before = system_stats::get_instance()->metadata_bytes();
+        for (size_t i = 0; i < 300; i++) {
+            char* ptr = (char*)tcmalloc(base + (i % 3) * 8192);
+            ptr[0] = 1;
+            ptr[base - 1] = 2;
+            tcfree(ptr);
+        }
+        assert(system_stats::get_instance()->system_bytes() <= system_before);
+        assert(system_stats::get_instance()->metadata_bytes() == metadata_before);
+    }
+    std::cout << "large reuse test run successful" << std::endl;
+}
+void metadata_churn_test() {
+    // 线程反复创建退出，大小对象混着申请释放: threadCache和span对象都在池子里复用，第一轮之后元数据不能再涨
+    auto round = [] {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 4; t++) {
+            threads.emplace_back([] {
+                std::vector<void*> v;
+                for (size_t i = 0; i < 2000; i++)
+                    v.push_back(tcmalloc(i % 4096 + 1));
+                v.push_back(tcmalloc((size_t)1 << 20));
+                for (auto e : v)
+                    tcfree(e);
+            });
+        }
+        for (auto& th : threads)
+            th.join();
+    };
+    round();
+    size_t before = system_stats::get_instance()->metadata_bytes();
+    for (size_t i = 0; i < 10; i++)
+        round();
+    assert(system_stats::get_instance()->metadata_bytes() == before);
+    tc_stats stats;
+    tcmalloc_get_stats(&stats);
+    assert(stats.metadata_unused_bytes < stats.metadata_bytes);
+    std::cout << "metadata churn test run successful" << std::endl;
+}
+#if defined(__linux__)
+// 把当前线程绑到第cpu个CPU上(机器上没有这么多CPU就绑到最后一个)
+static void bind_cpu(size_t cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(std::min(cpu, (size_t)std::thread::hardware_concurrency() - 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+#else
+static void bind_cpu(size_t) { }
+#endif
+// 当前进程的常驻内存(字节)
+static size_t rss_bytes() {
+    size_t pages = 0, resident = 0;
+#if defined(__linux__)
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f != nullptr) {
+        if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+#endif
+    return resident * sysconf(_SC_PAGESIZE);
+}
+void transfer_drain_test() {
+    // 一个线程突然申请很多小对象再全部释放，transfer cache里存着的批次不能把span一直占着
+    // release_memory之后常驻内存要降回去
+    size_t sizes[] = { 32, 256, 1024, 8192 };
+    page_cache::get_instance()->release_memory((size_t)1 << 40); // 前面的测试留下的空闲页先还掉
+    size_t before = rss_bytes();
+    std::thread burst([&]() {
+        std::vector<void*> v;
+        for (size_t size : sizes) {
+            for (size_t i = 0; i < (16 << 20) / size; i++) {
+                v.push_back(tcmalloc(size));
+                memset(v.back(), 0x5a, size);
+            }
+        }
+        for (auto e : v)
+            tcfree(e);
+    });
+    burst.join();
+    size_t peak = rss_bytes();
+    page_cache::get_instance()->release_memory((size_t)1 << 40);
+    size_t after = rss_bytes();
+    tc_stats st;
+    tcmalloc_get_stats(&st);
+    std::cout << "rss " << (before >> 20) << "MB -> " << (peak >> 20) << "MB -> " << (after >> 20) << "MB" << std::endl;
+    assert(st.transfer_cache_bytes == 0);
+#if defined(__linux__)
+    // 一共64MB，透明大页缺页的时候可能会多占一些，至少要降回一半
+    assert(peak > before + (32 << 20));
+    assert(after + (32 << 20) < peak);
+#endif
+    std::cout << "transfer drain test run successful" << std::endl;
+}
+void page_map_test() {
+    // 新建的radix树不带任何中间节点和叶子，只有Ensure过的页才建节点
+    size_t before = rss_bytes();
+    TCMalloc_PageMap3<PAGE_MAP_BITS>* map = new TCMalloc_PageMap3<PAGE_MAP_BITS>();
+    size_t last = ((size_t)1 << PAGE_MAP_BITS) - 1; // 48位地址空间的最后一页
+    assert(map->get(0) == nullptr && map->get(last) == nullptr && map->get_sizeclass(last) == 0);
+    assert(!map->Ensure(last + 1, 1)); // 超出48位了
+    // 一头一尾各用一页，中间的页号还是空的
+    assert(map->Ensure(0, 1) && map->Ensure(last, 1));
+    int x = 0;
+    map->set(0, &x);
+    map->set(last, &x);
+    map->set_sizeclass(last, 7);
+    assert(map->get(0) == &x && map->get(last) == &x && map->get_sizeclass(last) == 7);
+    assert(map->get(1) == nullptr && map->get(last / 2) == nullptr && map->get_sizeclass(0) == 0);
+    // 整层都建好的话光叶子就要几百MB，按需建只多了几个节点
+    assert(rss_bytes() < before + 16 * 1024 * 1024);
+    delete map;
+    std::cout << "page map test run successful" << std::endl;
+}
+void cpu_cache_test() {
+    // 要用 TCMALLOC_PER_CPU_CACHES=1 ./unit 跑，rseq不可用的时候跳过
+    if (!cpu_cache::get_instance()->active()) {
+        std::cout << "cpu cache test skipped (TCMALLOC_PER_CPU_CACHES=1 not set or rseq unavailable)" << std::endl;
+        return;
+    }
+    size_t size = 128;
+    size_t index = size_class::bucket_index(size);
+    // 申请的比一个桶能装的多很多，要补货很多次
+    std::vector<void*> v;
+    std::thread producer([&]() {
+        bind_cpu(0);
+        for (size_t i = 0; i < 4 * PER_CPU_CLASS_BYTES / size; i++) {
+            v.push_back(tcmalloc(size));
+            memset(v.back(), 0x5a, size);
+        }
+    });
+    producer.join();
+    assert(std::set<void*>(v.begin(), v.end()).size() == v.size());
+    // 在另一个CPU上释放，桶满了要还给centralCache
+    std::thread consumer([&]() {
+        bind_cpu(1);
+        for (auto e : v)
+            tcfree(e);
+    });
+    consumer.join();
+    tc_stats st;
+    tcmalloc_get_stats(&st);
+    assert(st.classes[index].cpu_objs > 0);
+    assert(st.classes[index].cpu_objs * size <= PER_CPU_CLASS_BYTES * std::thread::hardware_concurrency());
+    assert(st.classes[index].thread_objs == 0);
+    // 还回去的对象能再拿出来用
+    std::thread again([&]() {
+        bind_cpu(0);
+        for (auto& e : v) {
+            e = tcmalloc(size);
+            memset(e, 0xa5, size);
+        }
+        for (auto e : v)
+            tcfree(e);
+    });
+    again.join();
+    std::cout << "cpu cache test run successful" << std::endl;
+}
 int main() {
 // std::cout << "haha" << std::endl;
 // big_alloc();
-#ifdef __aarch64__
+#if defined(__aarch64__) || defined(__x86_64__)
     std::cout << "64" << std::endl;
 #elif defined(__arm__)
     std::cout << "32" << std::endl;
 #else
     std::cout << "unknown sys" << std::endl;
 #endif
+    thread_exit_test();
+    object_pool_reuse_test();
+    thread_budget_test();
+    page_shard_test();
+    release_memory_test();
+    returned_merge_test();
+    hugepage_release_test();
+    size_class_table_test();
+    sized_free_test();
+    size_class_map_test();
+    page_map_test();
+    aligned_alloc_test();
+    stats_test();
+    stats_concurrent_test();
+    remote_free_test();
+    dead_owner_test();
+    batch_test();
+    sample_test();
+    sample_large_test();
+    adaptive_list_test();
+    large_cache_test();
+    large_reuse_test();
+    metadata_churn_test();
+    transfer_drain_test();
+    cpu_cache_test();
     return 0;
 }
\ No newline at end of file